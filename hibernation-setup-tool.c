@@ -11,19 +11,28 @@
  */
 #include <sys/mount.h>
 
+#include <arpa/inet.h>
 #include <ctype.h>
 #include <dirent.h>
+#include <endian.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <ftw.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <linux/btrfs.h>
+#include <linux/btrfs_tree.h>
 #include <linux/falloc.h>
+#include <linux/fiemap.h>
 #include <linux/fs.h>
 #include <linux/ioctl.h>
 #include <linux/magic.h>
 #include <linux/suspend_ioctls.h>
 #include <mntent.h>
-#include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <spawn.h>
 #include <stdarg.h>
 #include <stdbool.h>
@@ -33,21 +42,31 @@
 #include <string.h>
 #include <sys/auxv.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/statfs.h>
 #include <sys/swap.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <sys/utsname.h>
 #include <sys/vfs.h>
 #include <sys/wait.h>
 #include <syscall.h>
 #include <syslog.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
 #define MEGA_BYTES (1ul << 20)
 #define GIGA_BYTES (1ul << 30)
 
+#ifndef SEEK_DATA
+#define SEEK_DATA 3
+#endif
+
 #ifndef SEEK_HOLE
 #define SEEK_HOLE 4
 #endif
@@ -68,7 +87,148 @@
 #define XFS_SUPER_MAGIC ('X' << 24 | 'F' << 16 | 'S' << 8 | 'B')
 #endif
 
-static const char swap_file_name[] = "/hibfile.sys";
+/* From fs/ext4/ext4.h; not exported to userspace headers. */
+struct move_extent {
+    uint32_t reserved;
+    uint32_t donor_fd;
+    uint64_t orig_start;
+    uint64_t donor_start;
+    uint64_t len;
+    uint64_t moved_len;
+};
+
+#ifndef EXT4_IOC_MOVE_EXT
+#define EXT4_IOC_MOVE_EXT _IOWR('f', 15, struct move_extent)
+#endif
+
+/* Where the hibernation file lives; see select_swap_file_location(). */
+static char swap_file_name[PATH_MAX] = "/hibfile.sys";
+
+/* Swap files with a capacity within this percentage of the needed size are
+ * kept as they are.  MemTotal often shifts by a few MB after a kernel update,
+ * and that alone shouldn't be a reason to touch the hibernation file. */
+static unsigned int swap_size_tolerance_pct = 2;
+
+/* How the size of the hibernation file is chosen: from a table of multiples
+ * of the RAM size, or from the largest image the kernel is expected to
+ * write, plus a safety margin (in percent) on top of that. */
+enum swap_sizing {
+    SWAP_SIZING_TABLE,
+    SWAP_SIZING_IMAGE,
+};
+static enum swap_sizing swap_sizing = SWAP_SIZING_TABLE;
+static unsigned int swap_sizing_margin_pct = 25;
+
+/* When the hibernation file has to be replaced, the new one is created and
+ * enabled next to the old one before the old one is disabled.  These are the
+ * names used while both exist. */
+static char swap_file_name_new[PATH_MAX] = "/hibfile.sys.new";
+static char swap_file_name_old[PATH_MAX] = "/hibfile.sys.old";
+
+/* On Btrfs, the hibernation file is kept in a subvolume of its own: snapshots
+ * of a subvolume with an active swap file can't be taken, and it's pointless
+ * to include gigabytes of swap in them anyway. */
+static const char btrfs_swap_subvolume[] = "/hibernation-swap";
+static bool btrfs_swap_subvolume_selected = false;
+
+/* Label written to the swap header of files we create. */
+static const char swap_volume_name[] = "hibernation";
+
+/* Progress of allocations and other things that have to survive a reboot
+ * are stored here. */
+static const char state_dir[] = "/var/lib/hibernation-setup-tool";
+static const char allocation_state_path[] = "/var/lib/hibernation-setup-tool/allocation";
+
+/* Fingerprint of the last successful configuration.  When nothing in it has
+ * changed, a run only has to tell the kernel where the swap area is again. */
+static const char fingerprint_path[] = "/var/lib/hibernation-setup-tool/state";
+#define FINGERPRINT_VERSION 1
+
+/* Do a full check even when the fingerprint says nothing has changed. */
+static bool force_full_run = false;
+
+/* Largest time, in seconds, writing or reading the hibernation image may
+ * take at the measured disk throughput.  If it'd take longer, image_size is
+ * lowered so the kernel frees more memory before hibernating, and the value
+ * chosen is saved with the fingerprint to be restored on later boots. */
+static unsigned int hibernate_time_budget_secs = 600;
+static size_t budget_image_size = 0;
+
+/* Longest budget or target time accepted (a day), so they can be
+ * multiplied by a throughput in bytes per second without overflowing. */
+#define MAX_HIBERNATE_TIME_SECS (24 * 60 * 60)
+
+/* Hibernation time to tune image_size for (--target-hibernate-time), and
+ * reserved_size to set (--reserved-size); 0 leaves the kernel's defaults.
+ * They're saved here, so the pre-hibernation hook can set them again. */
+static unsigned int target_hibernate_time_secs = 0;
+static size_t reserved_size_override = 0;
+static const char image_size_tuning_path[] = "/var/lib/hibernation-setup-tool/tuning";
+
+/* image_size and reserved_size that will be set once IMDS allows
+ * hibernation (0 if they'll be left alone), so the hibernation image can
+ * be estimated before anything is changed. */
+static size_t pending_image_size = 0;
+static size_t pending_reserved_size = 0;
+
+/* Choose the hibernation compressor and number of compression threads
+ * (--select-compressor), on kernels that allow it.  The choice is applied
+ * right away, and added to the kernel command line with the resume
+ * parameters; empty or 0 leaves the kernel's default. */
+static bool select_compressor = false;
+static char hibernation_compressor[16];
+static unsigned int hibernation_compression_threads = 0;
+/* What the choice was based on, saved with the fingerprint: the choice is
+ * made again when the number of CPUs changes. */
+static long compressor_selection_cpus = 0;
+static uint64_t compressor_selection_write_bps = 0;
+static uint64_t compressor_selection_read_bps = 0;
+
+/* Only estimate how well memory compresses, and exit (--report-compressibility). */
+static bool report_compressibility_only = false;
+
+/* swapoff() has to fault every page in the area back into memory, and this
+ * can take minutes on a busy machine.  Give up (and leave the old area
+ * enabled) after this many seconds; 0 waits for as long as it takes. */
+static unsigned int swapoff_timeout_secs = 600;
+
+/* Only defragment a newly created hibernation file if its fragmentation is
+ * estimated to slow down hibernation and resume by at least this percentage,
+ * and don't spend more than this many seconds doing it. */
+static unsigned int defrag_threshold_pct = 2;
+static unsigned int defrag_budget_secs = 120;
+
+/* Rough cost model used to estimate the fragmentation penalty: every
+ * discontiguous fragment costs an extra I/O request (a seek on spinning
+ * media, a round trip on network-attached disks) on top of streaming the
+ * data at a typical cloud disk throughput. */
+#define DEFRAG_ASSUMED_THROUGHPUT (200 * MEGA_BYTES)
+#define DEFRAG_FRAGMENT_COST_USEC 2000
+
+/* Limit on how much of the file the native ext4 defragmenter may rewrite, in
+ * addition to the time budget above. */
+static size_t defrag_io_budget = 16 * GIGA_BYTES;
+
+/* Fragments at least this large are left alone by the native ext4
+ * defragmenter (this is the largest extent ext4 can describe), and runs of
+ * smaller fragments are merged into ranges of up to this size. */
+#define DEFRAG_LARGE_FRAGMENT (128 * MEGA_BYTES)
+#define DEFRAG_MAX_RANGE GIGA_BYTES
+
+/* The hibernation file is allocated in chunks of this size, and progress is
+ * recorded after each one so an interrupted allocation can be resumed. */
+#define ALLOCATION_CHECKPOINT_SIZE (4 * GIGA_BYTES)
+
+/* Files that can't be allocated with fallocate() are written out instead,
+ * in chunks of this size, with this many writes in flight. */
+static size_t zero_out_chunk_size = 8 * MEGA_BYTES;
+static unsigned int zero_out_queue_depth = 4;
+
+/* Extent size hint given to XFS for the hibernation file, so it gets a few
+ * very large extents rather than whatever the allocator finds first.  XFS
+ * limits hints to a fraction of an allocation group, so the ioctl may fail
+ * on tiny file systems; that's harmless. */
+static size_t xfs_extent_size_hint = GIGA_BYTES;
 
 /* Prefixes are needed when running services. This makes it easier to grep for
  * code run via hibernate, resume hooks and hibernation tool. */
@@ -81,9 +241,23 @@ static bool log_needs_post_hook_prefix = false;
  * output will be stored in their journal files. */
 static bool log_needs_syslog = false;
 
-/* This is a link pointing to a file in a tmpfs filesystem and is mostly used to detect
- * if we got a cold boot or not. */
-static const char hibernate_lock_file_name[] = "/etc/hibernation-setup-tool.last_hibernation";
+/* The pre-hibernation hook stores the boot ID here.  Resuming restores the
+ * kernel's memory, boot ID included, so if the file is there when the tool
+ * starts on a boot with a different ID, the hibernation image wasn't resumed. */
+static const char hibernated_boot_id_path[] = "/var/lib/hibernation-setup-tool/hibernated-boot-id";
+
+/* Statistics of past hibernation cycles, gathered from the kernel log. */
+static const char hibernation_history_path[] = "/var/lib/hibernation-setup-tool/history";
+
+/* Metrics are written for node_exporter's textfile collector to this
+ * directory (--prometheus-dir), or to the default one if it exists. */
+static const char *prometheus_dir = NULL;
+static const char default_prometheus_dir[] = "/var/lib/prometheus/node-exporter";
+static const char counters_path[] = "/var/lib/hibernation-setup-tool/counters";
+
+/* Older versions detected cold boots with a link from here to a file in a
+ * tmpfs; it's only looked at to clean it up. */
+static const char legacy_hibernate_lock_file_name[] = "/etc/hibernation-setup-tool.last_hibernation";
 
 enum host_vm_notification {
     HOST_VM_NOTIFY_COLD_BOOT,                /* Sent every time system cold boots */
@@ -92,22 +266,274 @@ enum host_vm_notification {
     HOST_VM_NOTIFY_PRE_HIBERNATION_FAILED,   /* Sent on errors when hibernating or resuming */
 };
 
+struct file_extent {
+    uint64_t logical;
+    uint64_t physical;
+    uint64_t length;
+    uint32_t flags;
+};
+
+struct extent_map {
+    uint32_t block_size;
+    uint32_t flags; /* FIEMAP_EXTENT_* flags found in any extent */
+    uint64_t largest;
+    uint64_t smallest;
+    uint64_t mapped_bytes;
+    size_t n_fragments; /* Runs of extents that are contiguous on the device */
+    size_t n_extents;
+    struct file_extent extents[];
+};
+
+/* Layout of union swap_header in include/linux/swap.h.  The magic string
+ * takes the last bytes of the first page, whatever the page size is. */
+struct swap_header {
+    char bootbits[1024];
+    uint32_t version;
+    uint32_t last_page;
+    uint32_t nr_badpages;
+    unsigned char uuid[16];
+    char volume_name[16];
+    uint32_t padding[117];
+    uint32_t badpages[1];
+};
+
+#define SWAP_MAGIC "SWAPSPACE2"
+#define SWAP_MAGIC_LEN (sizeof(SWAP_MAGIC) - 1)
+
+enum allocation_phase {
+    ALLOCATION_IN_PROGRESS,
+    ALLOCATION_ALLOCATED,
+    ALLOCATION_DEFRAGMENTED,
+};
+
+struct allocation_state {
+    char path[PATH_MAX];
+    uint64_t inode;
+    uint64_t size;
+    uint64_t allocated;
+    enum allocation_phase phase;
+};
+
 struct swap_file {
     size_t capacity;
+    struct extent_map *extents; /* Lazily filled by swap_file_extents() */
     char path[];
 };
 
 static int ioprio_set(int which, int who, int ioprio) { return (int)syscall(SYS_ioprio_set, which, who, ioprio); }
 
-static void log_impl(int log_level, const char *fmt, va_list ap)
+static void json_escape(FILE *out, const char *str)
 {
-    if (log_needs_syslog) {
-        va_list ap_cpy; 
-        va_copy(ap_cpy, ap);
-        vsyslog(log_level, fmt, ap_cpy); 
-        va_end(ap_cpy); 
+    for (const unsigned char *p = (const unsigned char *)str; *p; p++) {
+        switch (*p) {
+        case '"':
+            fputs("\\\"", out);
+            break;
+        case '\\':
+            fputs("\\\\", out);
+            break;
+        case '\n':
+            fputs("\\n", out);
+            break;
+        case '\t':
+            fputs("\\t", out);
+            break;
+        default:
+            if (*p < 0x20)
+                fprintf(out, "\\u%04x", *p);
+            else
+                fputc(*p, out);
+        }
+    }
+}
+
+/* Messages are written to stdout as text by default.  When stdout is
+ * connected to the journal, they're sent straight to journald instead, one
+ * datagram per message, with the phase, swap file and hook attached as
+ * structured fields that can be queried with journalctl(1). */
+enum log_format {
+    LOG_FORMAT_AUTO,
+    LOG_FORMAT_TEXT,
+    LOG_FORMAT_JSON,
+    LOG_FORMAT_JOURNAL,
+};
+
+static enum log_format log_format = LOG_FORMAT_AUTO;
+static int journal_fd = -1;
+
+/* Structured fields attached to every message.  Phases are tracked per
+ * thread, as the IMDS query runs concurrently with the rest of the setup. */
+static __thread const char *log_phase = NULL;
+static char log_swap_path[PATH_MAX];
+static uint64_t log_resume_offset;
+static bool log_has_resume_offset = false;
+
+static const char journal_socket_path[] = "/run/systemd/journal/socket";
+
+static bool is_stdout_connected_to_journal(void)
+{
+    const char *journal_stream = getenv("JOURNAL_STREAM");
+    unsigned long long dev, ino;
+    struct stat st;
+
+    /* systemd sets this to the device and inode of the stream stdout is
+     * connected to; if they don't match, output was redirected elsewhere. */
+    if (!journal_stream || sscanf(journal_stream, "%llu:%llu", &dev, &ino) != 2)
+        return false;
+    if (fstat(STDOUT_FILENO, &st) < 0)
+        return false;
+
+    return st.st_dev == (dev_t)dev && st.st_ino == (ino_t)ino;
+}
+
+static int open_journal_socket(void)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    int fd;
+
+    fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+
+    memcpy(addr.sun_path, journal_socket_path, sizeof(journal_socket_path));
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* Called once from main(), before the IMDS thread is started, so the
+ * format never changes while messages are being logged.  Until then,
+ * messages are written as text. */
+static void resolve_log_format(void)
+{
+    if (log_format == LOG_FORMAT_AUTO) {
+        log_format = LOG_FORMAT_TEXT;
+
+        if (is_stdout_connected_to_journal()) {
+            journal_fd = open_journal_socket();
+            if (journal_fd >= 0)
+                log_format = LOG_FORMAT_JOURNAL;
+        }
+    } else if (log_format == LOG_FORMAT_JOURNAL && journal_fd < 0) {
+        journal_fd = open_journal_socket();
+        if (journal_fd < 0)
+            log_format = LOG_FORMAT_TEXT;
     }
+}
+
+static const char *log_hook(void)
+{
+    if (log_needs_pre_hook_prefix)
+        return "pre";
+    if (log_needs_post_hook_prefix)
+        return "post";
+    return NULL;
+}
+
+static const char *log_level_name(int log_level)
+{
+    switch (log_level) {
+    case LOG_ERR:
+        return "ERROR";
+    case LOG_NOTICE:
+        return "NOTICE";
+    case LOG_DEBUG:
+        return "DEBUG";
+    default:
+        return "INFO";
+    }
+}
+
+/* Appends a field in the journal native protocol.  Values with newlines
+ * need the binary form, with the value length as a little endian 64-bit
+ * integer; simple values use KEY=value. */
+static void journal_append_field(FILE *out, const char *key, const char *value)
+{
+    if (strchr(value, '\n')) {
+        uint64_t len = htole64(strlen(value));
+
+        fprintf(out, "%s\n", key);
+        fwrite(&len, sizeof(len), 1, out);
+        fprintf(out, "%s\n", value);
+    } else {
+        fprintf(out, "%s=%s\n", key, value);
+    }
+}
+
+static bool log_to_journal(int log_level, const char *message, int64_t duration_usec)
+{
+    char *datagram = NULL;
+    size_t len;
+    FILE *out;
+
+    out = open_memstream(&datagram, &len);
+    if (!out)
+        return false;
+
+    journal_append_field(out, "MESSAGE", message);
+    fprintf(out, "PRIORITY=%d\n", log_level);
+    journal_append_field(out, "SYSLOG_IDENTIFIER", "hibernation-setup-tool");
+    if (log_hook())
+        fprintf(out, "HOOK=%s\n", log_hook());
+    if (log_phase)
+        journal_append_field(out, "PHASE", log_phase);
+    if (duration_usec >= 0)
+        fprintf(out, "DURATION_USEC=%" PRId64 "\n", duration_usec);
+    if (log_swap_path[0])
+        journal_append_field(out, "SWAP_PATH", log_swap_path);
+    if (log_has_resume_offset)
+        fprintf(out, "OFFSET=%" PRIu64 "\n", log_resume_offset);
+
+    if (fclose(out) != 0) {
+        free(datagram);
+        return false;
+    }
+
+    bool sent = send(journal_fd, datagram, len, MSG_NOSIGNAL) == (ssize_t)len;
+    free(datagram);
+
+    return sent;
+}
+
+static void log_to_json(int log_level, const char *message, int64_t duration_usec)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    flockfile(stdout);
 
+    printf("{\"timestamp_usec\": %" PRId64 ", \"level\": \"%s\", \"message\": \"", (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000,
+           log_level_name(log_level));
+    json_escape(stdout, message);
+    putchar('"');
+    if (log_hook())
+        printf(", \"hook\": \"%s\"", log_hook());
+    if (log_phase) {
+        printf(", \"phase\": \"");
+        json_escape(stdout, log_phase);
+        putchar('"');
+    }
+    if (duration_usec >= 0)
+        printf(", \"duration_usec\": %" PRId64, duration_usec);
+    if (log_swap_path[0]) {
+        printf(", \"swap_path\": \"");
+        json_escape(stdout, log_swap_path);
+        putchar('"');
+    }
+    if (log_has_resume_offset)
+        printf(", \"offset\": %" PRIu64, log_resume_offset);
+    printf("}\n");
+    fflush(stdout);
+
+    funlockfile(stdout);
+}
+
+static void log_to_text(int log_level, const char *fmt, va_list ap)
+{
     flockfile(stdout);
 
     if (log_needs_tool_prefix)
@@ -129,6 +555,56 @@ static void log_impl(int log_level, const char *fmt, va_list ap)
     funlockfile(stdout);
 }
 
+/* Debug messages carry information that's only useful as structured
+ * fields (e.g. phase durations), so they're not written as text. */
+static void log_impl_fields(int log_level, int64_t duration_usec, const char *fmt, va_list ap)
+{
+    if (log_needs_syslog) {
+        va_list ap_cpy; 
+        va_copy(ap_cpy, ap);
+        vsyslog(log_level, fmt, ap_cpy); 
+        va_end(ap_cpy); 
+    }
+
+    if (log_format == LOG_FORMAT_JSON || log_format == LOG_FORMAT_JOURNAL) {
+        char *message;
+        va_list ap_cpy;
+
+        va_copy(ap_cpy, ap);
+        int ret = vasprintf(&message, fmt, ap_cpy);
+        va_end(ap_cpy);
+
+        if (ret >= 0) {
+            bool logged = true;
+
+            if (log_format == LOG_FORMAT_JOURNAL)
+                logged = log_to_journal(log_level, message, duration_usec);
+            else
+                log_to_json(log_level, message, duration_usec);
+
+            free(message);
+            if (logged)
+                return;
+        }
+    }
+
+    if (log_level != LOG_DEBUG)
+        log_to_text(log_level, fmt, ap);
+}
+
+static void log_impl(int log_level, const char *fmt, va_list ap) { log_impl_fields(log_level, -1, fmt, ap); }
+
+static void log_set_swap_file(const char *path)
+{
+    snprintf(log_swap_path, sizeof(log_swap_path), "%s", path);
+}
+
+static void log_set_resume_offset(uint64_t offset)
+{
+    log_resume_offset = offset;
+    log_has_resume_offset = true;
+}
+
 __attribute__((format(printf, 1, 2))) static void log_info(const char *fmt, ...)
 {
     va_list ap;
@@ -147,6 +623,15 @@ __attribute__((format(printf, 1, 2))) static void log_notice(const char *fmt, ..
     va_end(ap);
 }
 
+__attribute__((format(printf, 2, 3))) static void log_duration(int64_t duration_usec, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    log_impl_fields(LOG_DEBUG, duration_usec, fmt, ap);
+    va_end(ap);
+}
+
 __attribute__((format(printf, 1, 2))) __attribute__((noreturn)) static void log_fatal(const char *fmt, ...)
 {
     va_list ap;
@@ -159,6 +644,216 @@ __attribute__((format(printf, 1, 2))) __attribute__((noreturn)) static void log_
     __builtin_unreachable();
 }
 
+/* Every phase of a run is recorded here, and written out as Chrome trace
+ * event JSON (viewable in chrome://tracing or Perfetto) if --trace is given. */
+struct trace_event {
+    char *name;
+    const char *category;
+    int64_t ts_usec;
+    int64_t dur_usec;
+    pid_t tid;
+    char *args;
+};
+
+struct trace_io {
+    uint64_t rchar;
+    uint64_t wchar;
+    uint64_t read_bytes;
+    uint64_t write_bytes;
+};
+
+struct trace_phase {
+    const char *name;
+    const char *parent_name;
+    int64_t start_usec;
+    struct rusage usage;
+    struct trace_io io;
+};
+
+static const char *trace_path = NULL;
+/* Events are only recorded when something reads them: the trace file, or
+ * the phase durations exported to Prometheus.  CPU time and I/O counters
+ * are only collected for the trace file. */
+static bool trace_enabled = false;
+static struct trace_event *trace_events = NULL;
+static size_t n_trace_events = 0;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int64_t monotonic_usec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int64_t timeval_usec(const struct timeval *tv) { return (int64_t)tv->tv_sec * 1000000 + tv->tv_usec; }
+
+static void read_trace_io(struct trace_io *io)
+{
+    char buffer[128];
+    FILE *f;
+
+    memset(io, 0, sizeof(*io));
+
+    f = fopen("/proc/self/io", "re");
+    if (!f)
+        return;
+
+    while (fgets(buffer, sizeof(buffer), f)) {
+        uint64_t value;
+
+        if (sscanf(buffer, "rchar: %" SCNu64, &value) == 1)
+            io->rchar = value;
+        else if (sscanf(buffer, "wchar: %" SCNu64, &value) == 1)
+            io->wchar = value;
+        else if (sscanf(buffer, "read_bytes: %" SCNu64, &value) == 1)
+            io->read_bytes = value;
+        else if (sscanf(buffer, "write_bytes: %" SCNu64, &value) == 1)
+            io->write_bytes = value;
+    }
+
+    fclose(f);
+}
+
+static void trace_record(const char *name, const char *category, int64_t start_usec, int64_t end_usec, char *args)
+{
+    pthread_mutex_lock(&trace_lock);
+
+    struct trace_event *events = realloc(trace_events, (n_trace_events + 1) * sizeof(*events));
+    if (events) {
+        trace_events = events;
+        trace_events[n_trace_events++] = (struct trace_event){
+            .name = strdup(name),
+            .category = category,
+            .ts_usec = start_usec,
+            .dur_usec = end_usec - start_usec,
+            .tid = (pid_t)syscall(SYS_gettid),
+            .args = args,
+        };
+    } else {
+        free(args);
+    }
+
+    pthread_mutex_unlock(&trace_lock);
+}
+
+static void trace_begin(struct trace_phase *phase, const char *name)
+{
+    phase->name = name;
+    phase->parent_name = log_phase;
+    log_phase = name;
+    if (trace_path) {
+        getrusage(RUSAGE_SELF, &phase->usage);
+        read_trace_io(&phase->io);
+    }
+    phase->start_usec = monotonic_usec();
+}
+
+static void trace_end(struct trace_phase *phase)
+{
+    int64_t end_usec = monotonic_usec();
+    char *args = NULL;
+
+    if (trace_path) {
+        struct rusage usage;
+        struct trace_io io;
+
+        getrusage(RUSAGE_SELF, &usage);
+        read_trace_io(&io);
+
+        /* CPU time and I/O are process-wide, so phases running on other
+         * threads at the same time are included. */
+        if (asprintf(&args,
+                     "{\"utime_usec\": %" PRId64 ", \"stime_usec\": %" PRId64 ", \"max_rss_kb\": %ld, \"minor_faults\": %ld, \"major_faults\": %ld, "
+                     "\"rchar\": %" PRIu64 ", \"wchar\": %" PRIu64 ", \"read_bytes\": %" PRIu64 ", \"write_bytes\": %" PRIu64 "}",
+                     timeval_usec(&usage.ru_utime) - timeval_usec(&phase->usage.ru_utime),
+                     timeval_usec(&usage.ru_stime) - timeval_usec(&phase->usage.ru_stime), usage.ru_maxrss, usage.ru_minflt - phase->usage.ru_minflt,
+                     usage.ru_majflt - phase->usage.ru_majflt, io.rchar - phase->io.rchar, io.wchar - phase->io.wchar,
+                     io.read_bytes - phase->io.read_bytes, io.write_bytes - phase->io.write_bytes) < 0)
+            args = NULL;
+    }
+
+    if (trace_enabled)
+        trace_record(phase->name, "phase", phase->start_usec, end_usec, args);
+
+    log_duration(end_usec - phase->start_usec, "Phase `%s' took %" PRId64 " us", phase->name, end_usec - phase->start_usec);
+    log_phase = phase->parent_name;
+}
+
+static void trace_child(char *const argv[], int64_t start_usec, int wstatus, const struct rusage *usage)
+{
+    int64_t end_usec = monotonic_usec();
+    char *args = NULL;
+    size_t args_len;
+    FILE *out;
+
+    if (!trace_enabled)
+        return;
+
+    out = open_memstream(&args, &args_len);
+    if (!out)
+        return;
+
+    fputs("{\"argv\": \"", out);
+    for (int i = 0; argv[i]; i++) {
+        if (i)
+            fputc(' ', out);
+        json_escape(out, argv[i]);
+    }
+    fputc('"', out);
+
+    if (WIFEXITED(wstatus))
+        fprintf(out, ", \"exit_status\": %d", WEXITSTATUS(wstatus));
+    else if (WIFSIGNALED(wstatus))
+        fprintf(out, ", \"signal\": %d", WTERMSIG(wstatus));
+
+    if (usage) {
+        fprintf(out, ", \"utime_usec\": %" PRId64 ", \"stime_usec\": %" PRId64 ", \"max_rss_kb\": %ld, \"read_blocks\": %ld, \"write_blocks\": %ld",
+                timeval_usec(&usage->ru_utime), timeval_usec(&usage->ru_stime), usage->ru_maxrss, usage->ru_inblock, usage->ru_oublock);
+    }
+    fputc('}', out);
+    fclose(out);
+
+    trace_record(argv[0], "child", start_usec, end_usec, args);
+}
+
+static void write_trace(void)
+{
+    FILE *out;
+
+    if (!trace_path)
+        return;
+
+    out = fopen(trace_path, "we");
+    if (!out) {
+        log_info("Could not open %s for writing: %s", trace_path, strerror(errno));
+        return;
+    }
+
+    pthread_mutex_lock(&trace_lock);
+
+    fprintf(out, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    fprintf(out, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, \"args\": {\"name\": \"hibernation-setup-tool\"}}", getpid());
+    for (size_t i = 0; i < n_trace_events; i++) {
+        const struct trace_event *event = &trace_events[i];
+
+        fprintf(out, ",\n{\"name\": \"");
+        json_escape(out, event->name ? event->name : "?");
+        fprintf(out, "\", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %" PRId64 ", \"dur\": %" PRId64 ", \"pid\": %d, \"tid\": %d", event->category,
+                event->ts_usec, event->dur_usec, getpid(), event->tid);
+        if (event->args)
+            fprintf(out, ", \"args\": %s", event->args);
+        fputc('}', out);
+    }
+    fprintf(out, "\n]}\n");
+
+    pthread_mutex_unlock(&trace_lock);
+
+    if (fclose(out) != 0)
+        log_info("Could not write trace to %s: %s", trace_path, strerror(errno));
+}
+
 static char *next_field(char *current)
 {
     if (!current)
@@ -199,6 +894,24 @@ static size_t parse_size_or_die(const char *ptr, const char expected_end, char *
     return parsed;
 }
 
+/* Numeric options must be a plain decimal number no larger than max:
+ * strtoull() would also skip leading blanks and accept a minus sign,
+ * turning -1 into a huge number. */
+static size_t parse_option_or_die(const char *name, const char *arg, size_t max)
+{
+    unsigned long long parsed;
+    char *endptr;
+
+    errno = 0;
+    parsed = strtoull(arg, &endptr, 10);
+    if (!isdigit((unsigned char)arg[0]) || *endptr || errno)
+        log_fatal("Invalid value for --%s: `%s'", name, arg);
+    if (parsed > max)
+        log_fatal("Value for --%s must be at most %zu", name, max);
+
+    return (size_t)parsed;
+}
+
 static const char *find_executable_in_path(const char *name, const char *path_env, char path_buf[static PATH_MAX])
 {
     if (!path_env)
@@ -249,11 +962,20 @@ static struct swap_file *new_swap_file(const char *path, size_t capacity)
         log_fatal("Could not allocate memory for swap file information");
 
     out->capacity = capacity;
+    out->extents = NULL;
     memcpy(out->path, path, strlen(path) + 1);
 
     return out;
 }
 
+static void free_swap_file(struct swap_file *swap)
+{
+    if (swap) {
+        free(swap->extents);
+        free(swap);
+    }
+}
+
 static struct swap_file *find_swap_file(size_t needed_size)
 {
     char buffer[1024];
@@ -309,10 +1031,52 @@ static struct swap_file *find_swap_file(size_t needed_size)
     return out;
 }
 
-static size_t physical_memory(void)
+static bool get_active_swap_usage(const char *path, size_t *size_bytes, size_t *used_bytes)
+{
+    char buffer[1024];
+    FILE *swaps;
+    bool found = false;
+
+    swaps = fopen("/proc/swaps", "re");
+    if (!swaps)
+        log_fatal("Could not open /proc/swaps: is /proc mounted?");
+
+    /* Skip first line (header) */
+    if (!fgets(buffer, sizeof(buffer), swaps))
+        log_fatal("Could not skip first line from /proc/swaps");
+
+    while (fgets(buffer, sizeof(buffer), swaps)) {
+        char *filename = buffer;
+        char *type = next_field(filename);
+        char *size = next_field(type);
+        char *used = next_field(size);
+
+        if (!used)
+            continue;
+
+        if (strcmp(filename, path) != 0)
+            continue;
+
+        /* Both columns are in kB. */
+        if (size_bytes)
+            *size_bytes = parse_size_or_die(size, ' ', NULL) * 1024;
+        if (used_bytes)
+            *used_bytes = strtoull(used, NULL, 10) * 1024;
+
+        found = true;
+        break;
+    }
+
+    fclose(swaps);
+
+    return found;
+}
+
+static size_t meminfo_value(const char *field)
 {
     FILE *meminfo;
     char buffer[256];
+    size_t field_len = strlen(field);
     size_t total = 0;
 
     meminfo = fopen("/proc/meminfo", "re");
@@ -320,12 +1084,14 @@ static size_t physical_memory(void)
         log_fatal("Could not determine physical memory size. Is /proc mounted?");
 
     while (fgets(buffer, sizeof(buffer), meminfo)) {
-        static const size_t mem_total_len = sizeof("MemTotal: ") - 1;
-
-        if (!strncmp(buffer, "MemTotal: ", mem_total_len)) {
+        if (!strncmp(buffer, field, field_len) && buffer[field_len] == ':') {
+            char *value = buffer + field_len + 1;
             char *endptr;
 
-            total = parse_size_or_die(buffer + mem_total_len, ' ', &endptr);
+            while (isspace(*value))
+                value++;
+
+            total = parse_size_or_die(value, ' ', &endptr);
 
             if (!strcmp(endptr, " kB\n"))
                 total *= 1024;
@@ -336,7 +1102,7 @@ static size_t physical_memory(void)
             else if (!strcmp(endptr, " TB\n"))
                 total *= (size_t)MEGA_BYTES * (size_t)MEGA_BYTES;
             else
-                log_fatal("Could not determine unit for physical memory information");
+                log_fatal("Could not determine unit for %s in /proc/meminfo", field);
 
             break;
         }
@@ -346,7 +1112,9 @@ static size_t physical_memory(void)
     return total;
 }
 
-static size_t swap_needed_size(size_t phys_mem)
+static size_t physical_memory(void) { return meminfo_value("MemTotal"); }
+
+static size_t swap_size_from_table(size_t phys_mem)
 {
     /* This is using the recommendation from the Fedora project documentation. */
     if (phys_mem <= 2 * GIGA_BYTES)
@@ -359,7 +1127,7 @@ static size_t swap_needed_size(size_t phys_mem)
      * but we're extending this for a bit. */
     if (phys_mem <= 256 * GIGA_BYTES)
         return (5 * phys_mem) / 4;
-    log_fatal("Hibernation not recommended for a machine with more than 256GB of RAM");
+    return 0;
 }
 
 static size_t free_device_space()
@@ -418,14 +1186,16 @@ static char *get_uuid_for_dev_path(const char *path)
     return uuid;
 }
 
-static char *get_disk_uuid_for_file_path(const char *path)
+static bool find_mount_source_for_path(const char *path, char source[static PATH_MAX])
 {
     FILE *mounts = setmntent("/proc/mounts", "re");
     struct mntent *ent;
     struct stat st;
+    size_t best_len = 0;
+    bool found = false;
 
     if (!mounts)
-        return NULL;
+        return false;
 
     if (stat(path, &st) < 0)
         log_fatal("Could not stat(%s): %s", path, strerror(errno));
@@ -435,18 +1205,42 @@ static char *get_disk_uuid_for_file_path(const char *path)
 
         if (stat(ent->mnt_dir, &ent_st) < 0)
             continue;
-        if (ent_st.st_dev == st.st_dev)
+        if (ent_st.st_dev == st.st_dev) {
+            snprintf(source, PATH_MAX, "%s", ent->mnt_fsname);
+            found = true;
             break;
-    }
-
-    endmntent(mounts);
+        }
 
-    if (!ent) {
+        /* Btrfs subvolumes have a device number of their own, so files in
+         * a subvolume that isn't mounted by itself won't match any of the
+         * mount points; fall back to the mount point containing the path. */
+        size_t len = strlen(ent->mnt_dir);
+        if (len < best_len)
+            continue;
+        if (strncmp(path, ent->mnt_dir, len) != 0)
+            continue;
+        if (len > 1 && path[len] != '/' && path[len] != '\0')
+            continue;
+
+        snprintf(source, PATH_MAX, "%s", ent->mnt_fsname);
+        best_len = len;
+    }
+
+    endmntent(mounts);
+
+    return found || best_len;
+}
+
+static char *get_disk_uuid_for_file_path(const char *path)
+{
+    char source[PATH_MAX];
+
+    if (!find_mount_source_for_path(path, source)) {
         log_info("Could not determine device for file in path %s", path);
         return NULL;
     }
 
-    return get_uuid_for_dev_path(ent->mnt_fsname);
+    return get_uuid_for_dev_path(source);
 }
 
 static long determine_block_size_for_root_fs(void)
@@ -506,6 +1300,82 @@ static char *read_first_line_from_file(const char *path, char buffer[static 1024
     return buffer;
 }
 
+static bool ensure_state_dir(void)
+{
+    if (mkdir(state_dir, 0700) < 0 && errno != EEXIST) {
+        log_info("Could not create %s: %s", state_dir, strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+static bool write_file_atomically(const char *path, const char *contents, mode_t mode)
+{
+    char tmp_path[PATH_MAX];
+    size_t len = strlen(contents);
+    int fd;
+
+    /* Write to a temporary file and rename it over the destination, so
+     * nobody ever sees a partially written file. */
+    int r = snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    if (r < 0 || r >= (int)sizeof(tmp_path))
+        return false;
+
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_NOFOLLOW, mode);
+    if (fd < 0) {
+        log_info("Could not open %s for writing: %s", tmp_path, strerror(errno));
+        return false;
+    }
+
+    for (size_t written = 0; written < len;) {
+        ssize_t w = write(fd, contents + written, len - written);
+
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+
+            log_info("Could not write to %s: %s", tmp_path, strerror(errno));
+            close(fd);
+            unlink(tmp_path);
+            return false;
+        }
+        written += (size_t)w;
+    }
+
+    if (fchmod(fd, mode) < 0 || fsync(fd) < 0 || close(fd) < 0) {
+        log_info("Could not write to %s: %s", tmp_path, strerror(errno));
+        unlink(tmp_path);
+        return false;
+    }
+
+    if (rename(tmp_path, path) < 0) {
+        log_info("Could not rename %s to %s: %s", tmp_path, path, strerror(errno));
+        unlink(tmp_path);
+        return false;
+    }
+
+    return true;
+}
+
+static bool parse_state_line(char *line, char **key, char **value)
+{
+    char *eq = strchr(line, '=');
+
+    if (!eq)
+        return false;
+
+    *eq = '\0';
+    *key = line;
+    *value = eq + 1;
+
+    char *lf = strchr(*value, '\n');
+    if (lf)
+        *lf = '\0';
+
+    return true;
+}
+
 static bool is_hyperv(void) { return !access("/sys/bus/vmbus", F_OK); }
 
 static bool is_running_in_container(void)
@@ -596,88 +1466,97 @@ static bool is_hibernation_enabled_for_vm(void)
     return false;
 }
 
-static int open_and_get_socket(const char *host, int portno)
+/* IMDS is queried over a link-local address, so there's no name to resolve.
+ * The whole exchange, including retries, has to fit in this many seconds. */
+static const char imds_host[] = "169.254.169.254";
+static const int imds_port = 80;
+static unsigned int imds_deadline_secs = 20;
+
+/* A VM that allows hibernation keeps allowing it, so that answer is kept for
+ * this many seconds (0 disables the cache), as long as the VM ID stays the
+ * same.  Negative answers aren't cached: hibernation can be enabled on a
+ * deallocated VM without its ID changing. */
+static const char imds_cache_path[] = "/var/lib/hibernation-setup-tool/imds";
+static unsigned int imds_cache_ttl_secs = 7 * 24 * 60 * 60;
+
+enum imds_result {
+    IMDS_ALLOWED,
+    IMDS_NOT_ALLOWED,
+    IMDS_RETRY,
+};
+
+struct imds_probe {
+    pthread_t thread;
+    bool started;
+    bool allowed;
+};
+
+static int64_t monotonic_msec(void) { return monotonic_usec() / 1000; }
+
+static bool wait_for_socket(int fd, short events, int64_t deadline)
 {
-    struct hostent *server;
-    struct sockaddr_in serv_addr;
-    int sockfd;
+    struct pollfd pfd = {.fd = fd, .events = events};
 
-    /* create the socket */
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0)
-    {
-        log_info("Error opening socket: %s", strerror(errno));
-        return -1;
+    for (;;) {
+        int64_t remaining = deadline - monotonic_msec();
+        if (remaining <= 0) {
+            errno = ETIMEDOUT;
+            return false;
+        }
+
+        int r = poll(&pfd, 1, (int)remaining);
+        if (r > 0)
+            return true;
+        if (r == 0) {
+            errno = ETIMEDOUT;
+            return false;
+        }
+        if (errno != EINTR)
+            return false;
     }
+}
 
-    struct timeval timeout;
-    timeout.tv_sec = 10;
-    timeout.tv_usec = 0;
+static int imds_connect(int64_t deadline)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(imds_port),
+    };
+    int sockfd;
 
-    if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout) < 0 ||
-        setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout) < 0)
-    {
-        log_info("Unable to set timeouts for socket: %s", strerror(errno));
-        close(sockfd);
+    if (inet_pton(AF_INET, imds_host, &addr.sin_addr) != 1) {
+        log_info("Invalid IMDS address %s", imds_host);
         return -1;
     }
 
-    /* lookup the ip address */
-    server = gethostbyname(host);
-    if (server == NULL)
-    {
-        log_info("Unable to fetch host info %s: %s", host, strerror(h_errno));
-        close(sockfd);
+    sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sockfd < 0) {
+        log_info("Error opening socket: %s", strerror(errno));
         return -1;
     }
 
-    /* fill in the structure */
-    memset(&serv_addr, 0, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(portno);
-    memcpy(&serv_addr.sin_addr.s_addr, server->h_addr, server->h_length);
+    if (connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        int error = 0;
+        socklen_t len = sizeof(error);
 
-    /* connect the socket */
-    if (connect(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
-    {
-        log_info("Unable to connect to host %s: %s", host, strerror(errno));
-        close(sockfd);
-        return -1;
+        if (errno != EINPROGRESS || !wait_for_socket(sockfd, POLLOUT, deadline) || getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &error, &len) < 0) {
+            log_info("Unable to connect to host %s: %s", imds_host, strerror(errno));
+            close(sockfd);
+            return -1;
+        }
+        if (error) {
+            log_info("Unable to connect to host %s: %s", imds_host, strerror(error));
+            close(sockfd);
+            return -1;
+        }
     }
 
     return sockfd;
 }
 
-static bool is_hibernation_allowed_for_vm(void)
+static enum imds_result parse_imds_response(char *response, size_t len)
 {
-    int portno = 80;
-    char response[4096];
-    int sockfd, read_bytes;
-
-    const char *imds_host = "169.254.169.254";
-    const char *imds_req = "GET /metadata/instance/compute/additionalCapabilities/hibernationEnabled?api-version=2021-11-01&format=text HTTP/1.1\r\nHost: %s\r\nMetadata:true\r\n\r\n";
-    size_t req_size = strlen(imds_req) + strlen(imds_host) + 1;
-    char request[req_size];
-    snprintf(request, req_size, imds_req, imds_host);
-
-    sockfd = open_and_get_socket(imds_host, portno);
-    if(sockfd < 0)
-        return false;
-
-    log_info("IMDS Request:\n%s\n", request);
-
-    /*
-        Sample request -
-            GET /metadata/instance/compute/additionalCapabilities/hibernationEnabled?api-version=2021-11-01&format=text HTTP/1.1
-            Host: 169.254.169.254
-            Metadata:true
-    */
-    if (write(sockfd, request, strlen(request)) < 0)
-    {
-        log_info("Failed to write to socket: %s", strerror(errno));
-        close(sockfd);
-        return false;
-    }
+    unsigned int status;
 
     /*
         Sample response -
@@ -689,922 +1568,4311 @@ static bool is_hibernation_allowed_for_vm(void)
 
             true    (or false)
     */
-    read_bytes = read(sockfd, response, sizeof(response) - 1);
-    if (read_bytes < 0)
-    {
-        log_info("Failed to read from socket: %s", strerror(errno));
-        close(sockfd);
-        return false;
+    if (sscanf(response, "HTTP/%*u.%*u %u", &status) != 1) {
+        log_info("Malformed IMDS response status line");
+        return IMDS_RETRY;
     }
-    else if (read_bytes == 0)
-    {
-        log_info("IMDS connection closed prematurely without returning any response");
-        close(sockfd);
-        return false;
+
+    char *body = strstr(response, "\r\n\r\n");
+    if (!body) {
+        log_info("IMDS response ended before the headers did");
+        return IMDS_RETRY;
+    }
+    *body = '\0';
+    body += 4;
+
+    size_t body_len = len - (size_t)(body - response);
+    for (char *line = strstr(response, "\r\n"); line; line = strstr(line, "\r\n")) {
+        line += 2;
+        if (!strncasecmp(line, "Content-Length:", sizeof("Content-Length:") - 1)) {
+            size_t content_length = strtoul(line + sizeof("Content-Length:") - 1, NULL, 10);
+
+            if (content_length > body_len) {
+                log_info("IMDS response body is truncated (%zu of %zu bytes)", body_len, content_length);
+                return IMDS_RETRY;
+            }
+            body_len = content_length;
+            body[body_len] = '\0';
+        }
     }
 
-    response[read_bytes] = '\0';
+    log_info("IMDS responded with status %u: %s", status, body);
 
-    /* close the socket */
-    close(sockfd);
+    /* IMDS asks to be retried on these; see its documentation. */
+    if (status == 410 || status == 429 || status >= 500)
+        return IMDS_RETRY;
+    if (status != 200)
+        return IMDS_NOT_ALLOWED;
 
-    /* process response */
-    log_info("IMDS Response:\n%s\n", response);
-    if(strstr(response, "true"))
-    {
-        log_info("Hibernation is allowed for this VM");
-        return true;
-    }
-    return false;
+    while (body_len && isspace((unsigned char)body[body_len - 1]))
+        body[--body_len] = '\0';
+
+    return strcmp(body, "true") ? IMDS_NOT_ALLOWED : IMDS_ALLOWED;
 }
 
-static uint32_t get_swap_file_offset(int fd)
+static enum imds_result query_imds(int64_t deadline)
 {
-    uint32_t blksize;
+    char request[512];
+    char response[4096];
+    size_t received = 0;
+    int sockfd;
+
+    /*
+        Sample request -
+            GET /metadata/instance/compute/additionalCapabilities/hibernationEnabled?api-version=2021-11-01&format=text HTTP/1.1
+            Host: 169.254.169.254
+            Metadata:true
+            Connection: close
+    */
+    int len = snprintf(request, sizeof(request),
+                       "GET /metadata/instance/compute/additionalCapabilities/hibernationEnabled?api-version=2021-11-01&format=text HTTP/1.1\r\n"
+                       "Host: %s\r\nMetadata:true\r\nConnection: close\r\n\r\n",
+                       imds_host);
+
+    sockfd = imds_connect(deadline);
+    if (sockfd < 0)
+        return IMDS_RETRY;
 
-    if (ioctl(fd, FIGETBSZ, &blksize) < 0)
-        log_fatal("Could not get file block size: %s", strerror(errno));
+    for (int sent = 0; sent < len;) {
+        ssize_t w = send(sockfd, request + sent, (size_t)(len - sent), MSG_NOSIGNAL);
 
-    uint32_t last = 0, first = 0, num_contiguous_blocks = 0;
-    uint32_t blocks_per_page = sysconf(_SC_PAGE_SIZE) / blksize;
-    uint32_t first_blknum = ~0;
-    for (uint32_t i = 0; i < blocks_per_page; i++) {
-        uint32_t blknum = i;
+        if (w < 0) {
+            if (errno == EINTR || ((errno == EAGAIN || errno == EWOULDBLOCK) && wait_for_socket(sockfd, POLLOUT, deadline)))
+                continue;
 
-        if (ioctl(fd, FIBMAP, &blknum) < 0)
-            log_fatal("Could not get filesystem block number for block #%d: %s", i, strerror(errno));
+            log_info("Failed to write to socket: %s", strerror(errno));
+            close(sockfd);
+            return IMDS_RETRY;
+        }
+        sent += (int)w;
+    }
 
-        if (i == 0)
-            first_blknum = blknum;
+    /* The server closes the connection after the response, so read until
+     * then; responses can arrive in several segments. */
+    while (received < sizeof(response) - 1) {
+        ssize_t r = recv(sockfd, response + received, sizeof(response) - 1 - received, 0);
 
-        if (last && blknum - last != 1) {
-            /* If we find a block that's not contiguous, bail out.  We
-             * check below if we have enough contiguous blocks for hibernation
-             * to work. */
+        if (r == 0)
             break;
+        if (r < 0) {
+            if (errno == EINTR || ((errno == EAGAIN || errno == EWOULDBLOCK) && wait_for_socket(sockfd, POLLIN, deadline)))
+                continue;
+
+            log_info("Failed to read from socket: %s", strerror(errno));
+            close(sockfd);
+            return IMDS_RETRY;
         }
+        received += (size_t)r;
+    }
 
-        if (!first)
-            first = blknum;
+    close(sockfd);
 
-        last = blknum;
-        num_contiguous_blocks++;
+    if (!received) {
+        log_info("IMDS connection closed prematurely without returning any response");
+        return IMDS_RETRY;
     }
 
-    log_info("First %d blocks of %d bytes are contiguous", num_contiguous_blocks, blksize);
-
-    if (num_contiguous_blocks * blksize >= sysconf(_SC_PAGE_SIZE))
-        return first_blknum;
+    response[received] = '\0';
 
-    return ~0;
+    return parse_imds_response(response, received);
 }
 
-static bool try_zero_out_with_write(const char *path, off_t needed_size)
+static enum imds_result query_imds_until_deadline(void)
 {
-    int fd = open(path, O_WRONLY | O_CLOEXEC);
-    int ret = true;
+    int64_t deadline = monotonic_msec() + (int64_t)imds_deadline_secs * 1000;
+    unsigned int backoff_msec = 100;
 
-    if (fd < 0) {
-        log_info("Could not open %s: %s", path, strerror(errno));
-        return false;
-    }
+    for (;;) {
+        enum imds_result result = query_imds(deadline);
 
-    long block_size = determine_block_size_for_root_fs();
-    const uint32_t pattern = 'T' << 24 | 'F' << 16 | 'S' << 8 | 'M';
-    for (off_t offset = 0; offset < needed_size; offset += block_size) {
-        ssize_t written = pwrite(fd, &pattern, sizeof(pattern), offset);
+        if (result != IMDS_RETRY)
+            return result;
 
-        if (written < 0) {
-            log_info("Could not write pattern to %s: %s", path, strerror(errno));
-            ret = false;
-            goto out;
+        int64_t remaining = deadline - monotonic_msec();
+        if (remaining <= (int64_t)backoff_msec) {
+            log_info("Giving up on IMDS after %u seconds", imds_deadline_secs);
+            return IMDS_RETRY;
         }
-    }
-
-    fdatasync(fd);
-out:
-    close(fd);
 
-    return ret;
+        log_info("Retrying IMDS query in %u ms", backoff_msec);
+        usleep(backoff_msec * 1000);
+        if (backoff_msec < 3200)
+            backoff_msec *= 2;
+    }
 }
 
-static bool fs_set_flags(int fd, int flags_to_set, int flags_to_reset)
+static bool load_cached_imds_verdict(const char *vm_id, bool *allowed)
 {
-    int current_flags;
+    char buffer[256];
+    char cached_vm_id[128] = "";
+    int64_t timestamp = -1;
+    int verdict = -1;
+    FILE *f;
 
-    if (ioctl(fd, FS_IOC_GETFLAGS, &current_flags) < 0)
+    if (!imds_cache_ttl_secs || !vm_id[0])
         return false;
 
-    current_flags |= flags_to_set;
-    current_flags &= ~flags_to_reset;
+    f = fopen(imds_cache_path, "re");
+    if (!f)
+        return false;
 
-    if (ioctl(fd, FS_IOC_SETFLAGS, &current_flags) < 0)
+    while (fgets(buffer, sizeof(buffer), f)) {
+        char *key, *value;
+
+        if (!parse_state_line(buffer, &key, &value))
+            continue;
+
+        if (!strcmp(key, "vm_id"))
+            snprintf(cached_vm_id, sizeof(cached_vm_id), "%s", value);
+        else if (!strcmp(key, "allowed"))
+            verdict = atoi(value);
+        else if (!strcmp(key, "timestamp"))
+            timestamp = strtoll(value, NULL, 10);
+    }
+
+    fclose(f);
+
+    if (verdict <= 0 || timestamp < 0)
+        return false;
+
+    /* A different VM ID means this disk has been attached to (or cloned
+     * into) another VM, which might not allow hibernation. */
+    if (strcmp(cached_vm_id, vm_id) != 0) {
+        log_info("VM ID changed since IMDS was last queried; ignoring cached answer");
+        return false;
+    }
+
+    int64_t age = (int64_t)time(NULL) - timestamp;
+    if (age < 0 || age >= (int64_t)imds_cache_ttl_secs)
         return false;
 
+    log_info("Using IMDS answer cached %" PRId64 " seconds ago", age);
+    *allowed = verdict;
+
     return true;
 }
 
-static bool is_file_on_fs(const char *path, __fsword_t magic)
+static void save_imds_verdict(const char *vm_id, bool allowed)
 {
-    struct statfs stfs;
+    char *contents;
 
-    if (!statfs(path, &stfs))
-        return stfs.f_type == magic;
+    if (!allowed) {
+        if (unlink(imds_cache_path) < 0 && errno != ENOENT)
+            log_info("Could not remove %s: %s", imds_cache_path, strerror(errno));
+        return;
+    }
 
-    return false;
+    if (!imds_cache_ttl_secs || !vm_id[0])
+        return;
+
+    if (asprintf(&contents, "vm_id=%s\nallowed=%d\ntimestamp=%" PRId64 "\n", vm_id, allowed, (int64_t)time(NULL)) < 0)
+        log_fatal("Could not allocate memory for IMDS cache");
+
+    if (!ensure_state_dir() || !write_file_atomically(imds_cache_path, contents, 0600))
+        log_info("Could not cache IMDS answer; it'll be queried again next time");
+
+    free(contents);
 }
 
-static bool create_swap_file_with_size(const char *path, off_t size)
+static bool is_hibernation_allowed_for_vm(void)
 {
-    int fd = open(path, O_CLOEXEC | O_WRONLY | O_CREAT, 0600);
-    int rc;
+    char buffer[1024];
+    const char *vm_id;
+    bool allowed;
 
-    if (fd < 0)
-        return false;
+    vm_id = read_first_line_from_file("/sys/class/dmi/id/product_uuid", buffer);
+    if (!vm_id)
+        vm_id = "";
 
-    /* Disabling CoW is necessary on btrfs filesystems, but issue the
-     * ioctl regardless of the filesystem just in case.
-     * More information: https://wiki.archlinux.org/index.php/btrfs#Swap_file
-     */
-    if (!fs_set_flags(fd, FS_NOCOW_FL, 0)) {
-        /* Some filesystems don't support CoW (EXT4 for instance), so don't bother
-         * giving an error message in those cases. */
-        if (errno != EOPNOTSUPP)
-            log_info("Could not disable CoW for %s: %s. Will try setting up swap anyway.", path, strerror(errno));
-    }
-    /* Disable compression, too. */
-    if (!fs_set_flags(fd, FS_NOCOMP_FL, FS_COMPR_FL)) {
-        /* Compression is optional, too, so don't bother giving an error message in
-         * case the filesystem doesn't support it. */
-        if (errno != EOPNOTSUPP)
-            log_info("Could not disable compression for %s: %s. Will try setting up swap anyway.", path, strerror(errno));
-    }
+    if (!load_cached_imds_verdict(vm_id, &allowed)) {
+        enum imds_result result = query_imds_until_deadline();
 
-    if (is_file_on_fs(path, XFS_SUPER_MAGIC)) {
-        rc = 0;
-    } else {
-        rc = ftruncate(fd, size);
-        if (rc < 0) {
-            if (errno == EPERM) {
-                log_info("Not enough disk space to create %s with %zu MB.", path, size / MEGA_BYTES);
-            } else {
-                log_info("Could not resize %s to %ld MB: %s", path, size / MEGA_BYTES, strerror(errno));
-            }
-        }
+        /* A timeout says nothing about the VM, so leave the cache alone. */
+        if (result == IMDS_RETRY)
+            return false;
+
+        allowed = result == IMDS_ALLOWED;
+        save_imds_verdict(vm_id, allowed);
     }
 
-    close(fd);
+    if (allowed)
+        log_info("Hibernation is allowed for this VM");
 
-    return rc == 0;
+    return allowed;
 }
 
-static bool try_zeroing_out_with_fallocate(const char *path, off_t size)
+static void *imds_probe_thread(void *arg)
 {
-    int fd = open(path, O_CLOEXEC | O_WRONLY);
+    struct imds_probe *probe = arg;
+    struct trace_phase phase;
 
-    if (fd < 0) {
-        log_info("Could not open %s for writing: %s", path, strerror(errno));
-        return false;
-    }
+    trace_begin(&phase, "IMDS");
+    probe->allowed = is_hibernation_allowed_for_vm();
+    trace_end(&phase);
 
-    if (fallocate(fd, 0, 0, size) < 0) {
-        int fallocate_errno = errno; 
-        if (unlink(path) < 0)
-            log_info("Couldn't remove incomplete hibernation file %s: %s", path, strerror(errno));
+    return NULL;
+}
 
-        if (fallocate_errno == ENOSPC) {
-            log_fatal("System ran out of disk space while allocating hibernation file. It needs %zd MiB", size / MEGA_BYTES);
-        } else {
-            log_fatal("Could not allocate %s: %s", path, strerror(fallocate_errno));
-        }
-    }
+/* The IMDS query is done while the local state is being examined; only
+ * finish_imds_probe() has to be called before anything is changed. */
+static void start_imds_probe(struct imds_probe *probe)
+{
+    int r = pthread_create(&probe->thread, NULL, imds_probe_thread, probe);
 
-    close(fd);
+    probe->started = r == 0;
+    if (r)
+        log_info("Could not start IMDS query in the background: %s; doing it now", strerror(r));
+}
 
-    return true;
+static bool finish_imds_probe(struct imds_probe *probe)
+{
+    if (!probe->started)
+        return is_hibernation_allowed_for_vm();
+
+    pthread_join(probe->thread, NULL);
+    probe->started = false;
+
+    return probe->allowed;
 }
 
-static bool try_vspawn_and_wait(const char *program, int n_args, va_list ap)
+static struct extent_map *append_extents(struct extent_map *map, const struct fiemap *fm)
 {
-    pid_t pid;
-    int rc;
-    char **argv;
+    struct extent_map *tmp = realloc(map, sizeof(*map) + (map->n_extents + fm->fm_mapped_extents) * sizeof(map->extents[0]));
 
-    argv = calloc(n_args + 2, sizeof(char *));
-    if (!argv) {
-        log_info("Couldn't allocate memory for argument array");
-        return false;
-    }
+    if (!tmp)
+        log_fatal("Could not allocate memory for extent map");
+    map = tmp;
 
-    argv[0] = (char *)program;
-    for (int i = 1; i <= n_args; i++)
-        argv[i] = va_arg(ap, char *);
+    for (uint32_t i = 0; i < fm->fm_mapped_extents; i++) {
+        const struct fiemap_extent *fe = &fm->fm_extents[i];
 
-    rc = posix_spawnp(&pid, program, NULL, NULL, argv, NULL);
+        if (map->n_extents) {
+            const struct file_extent *prev = &map->extents[map->n_extents - 1];
 
-    free(argv);
+            if (fe->fe_logical != prev->logical + prev->length || fe->fe_physical != prev->physical + prev->length)
+                map->n_fragments++;
+        } else {
+            map->n_fragments++;
+        }
 
-    if (rc != 0) {
-        log_info("Could not spawn %s: %s", program, strerror(rc));
-        return false;
+        map->extents[map->n_extents++] = (struct file_extent){
+            .logical = fe->fe_logical,
+            .physical = fe->fe_physical,
+            .length = fe->fe_length,
+            .flags = fe->fe_flags,
+        };
+
+        map->flags |= fe->fe_flags;
+        map->mapped_bytes += fe->fe_length;
+        if (fe->fe_length > map->largest)
+            map->largest = fe->fe_length;
+        if (fe->fe_length < map->smallest)
+            map->smallest = fe->fe_length;
     }
 
-    log_info("Waiting for %s (pid %d) to finish.", program, pid);
+    return map;
+}
 
-    int wstatus;
-    if (waitpid(pid, &wstatus, 0) != pid) {
-        log_info("Couldn't wait for %s: %s", program, strerror(errno));
-        return false;
-    }
-    if (!WIFEXITED(wstatus)) {
-        log_info("%s ended abnormally: %s", program, strerror(errno));
-        return false;
-    }
-    if (WEXITSTATUS(wstatus) == 127) {
-        log_info("Failed to spawn %s", program);
-        return false;
-    }
-    if (WEXITSTATUS(wstatus) != 0) {
-        log_info("%s ended with unexpected exit code %d", program, WEXITSTATUS(wstatus));
-        return false;
-    }
-
-    log_info("%s finished successfully.", program);
-    return true;
-}
+/* On Btrfs, FIEMAP reports addresses in the file system's logical address
+ * space, which spans all of its devices.  The kernel wants resume_offset
+ * (and SNAPSHOT_SET_SWAP_AREA) relative to the start of the block device, so
+ * translate through the chunk tree, like "btrfs inspect-internal
+ * map-swapfile" does. */
+struct btrfs_chunk_mapping {
+    uint64_t logical;
+    uint64_t length;
+    uint64_t type;
+    uint64_t physical;
+};
 
-static bool try_spawn_and_wait(const char *program, int n_args, ...)
+static struct btrfs_chunk_mapping *load_btrfs_chunk_mappings(int fd, size_t *n_chunks)
 {
-    va_list ap;
-    bool spawned;
+    struct btrfs_ioctl_search_args args = {
+        .key =
+            {
+                .tree_id = BTRFS_CHUNK_TREE_OBJECTID,
+                .min_objectid = BTRFS_FIRST_CHUNK_TREE_OBJECTID,
+                .max_objectid = BTRFS_FIRST_CHUNK_TREE_OBJECTID,
+                .min_type = BTRFS_CHUNK_ITEM_KEY,
+                .max_type = BTRFS_CHUNK_ITEM_KEY,
+                .max_offset = UINT64_MAX,
+                .max_transid = UINT64_MAX,
+            },
+    };
+    struct btrfs_chunk_mapping *chunks = NULL;
+    size_t n = 0;
 
-    va_start(ap, n_args);
-    spawned = try_vspawn_and_wait(program, n_args, ap);
-    va_end(ap);
+    for (;;) {
+        args.key.nr_items = 4096;
 
-    return spawned;
-}
+        if (ioctl(fd, BTRFS_IOC_TREE_SEARCH, &args) < 0) {
+            log_info("Could not search Btrfs chunk tree: %s", strerror(errno));
+            free(chunks);
+            return NULL;
+        }
 
-static void spawn_and_wait(const char *program, int n_args, ...)
-{
-    va_list ap;
-    bool spawned;
+        if (!args.key.nr_items)
+            break;
 
-    va_start(ap, n_args);
-    spawned = try_vspawn_and_wait(program, n_args, ap);
-    va_end(ap);
+        size_t pos = 0;
+        for (uint32_t i = 0; i < args.key.nr_items; i++) {
+            struct btrfs_ioctl_search_header header;
+            struct btrfs_chunk chunk;
 
-    if (!spawned)
-        log_fatal("Aborting program due to error condition when spawning %s", program);
-}
+            memcpy(&header, args.buf + pos, sizeof(header));
+            pos += sizeof(header);
 
-static void perform_fs_specific_checks(const char *path)
-{
-    /* Not performing defragmentation for xfs file systems as xfs_fsr process is taking time for SKUs with larger RAM.
-       While it is good to have optimization, not ideal to have performance hit on the tool */
+            if (header.type == BTRFS_CHUNK_ITEM_KEY && header.len >= sizeof(chunk)) {
+                memcpy(&chunk, args.buf + pos, sizeof(chunk));
 
-    if (is_file_on_fs(path, EXT4_SUPER_MAGIC) && is_exec_in_path("e4defrag")) {
-        try_spawn_and_wait("e4defrag", 1, path);
-        return;
-    }
+                chunks = realloc(chunks, (n + 1) * sizeof(*chunks));
+                if (!chunks)
+                    log_fatal("Could not allocate memory for Btrfs chunk map");
 
-    if (is_file_on_fs(path, BTRFS_SUPER_MAGIC)) {
-        struct utsname utsbuf;
+                chunks[n++] = (struct btrfs_chunk_mapping){
+                    .logical = header.offset,
+                    .length = le64toh(chunk.length),
+                    .type = le64toh(chunk.type),
+                    .physical = le64toh(chunk.stripe.offset),
+                };
+            }
 
-        if (uname(&utsbuf) < 0)
-            log_fatal("Could not determine Linux kernel version: %s", strerror(errno));
-        if (utsbuf.release[1] != '.')
-            log_fatal("Could not parse Linux kernel version");
-        if (utsbuf.release[0] < '5')
-            log_fatal("Swap files are not supported on Btrfs running on kernel %s", utsbuf.release);
+            pos += header.len;
+            args.key.min_offset = header.offset + 1;
+        }
 
-        if (is_exec_in_path("btrfs"))
-            try_spawn_and_wait("btrfs", 3, "filesystem", "defragment", path);
-        return;
+        if (!args.key.min_offset)
+            break;
     }
+
+    *n_chunks = n;
+    return chunks;
 }
 
-bool is_kernel_version_at_least(const char *version)
+static void map_btrfs_extents_to_device(int fd, struct extent_map *map)
 {
-    struct utsname my_uname;
-    if (uname(&my_uname) == -1) {
-        log_info("uname call failed.");
-        return true;
+    struct btrfs_chunk_mapping *chunks;
+    size_t n_chunks;
+
+    if (!map->n_extents)
+        return;
+
+    chunks = load_btrfs_chunk_mappings(fd, &n_chunks);
+
+    /* Extents that can't be translated are flagged, so nothing will try to
+     * use their addresses for resume_offset. */
+    for (size_t i = 0; i < map->n_extents; i++) {
+        struct file_extent *extent = &map->extents[i];
+        const struct btrfs_chunk_mapping *chunk = NULL;
+
+        for (size_t j = 0; chunks && j < n_chunks; j++) {
+            if (extent->physical >= chunks[j].logical && extent->physical - chunks[j].logical < chunks[j].length) {
+                chunk = &chunks[j];
+                break;
+            }
+        }
+
+        if (!chunk || chunk->type & BTRFS_BLOCK_GROUP_PROFILE_MASK) {
+            extent->flags |= FIEMAP_EXTENT_UNKNOWN;
+            map->flags |= FIEMAP_EXTENT_UNKNOWN;
+            continue;
+        }
+
+        extent->physical = chunk->physical + (extent->physical - chunk->logical);
     }
-    unsigned sys_major_version = 0, sys_minor_version = 0;
-    unsigned req_major_version = 0, req_minor_version = 0;
-    sscanf(my_uname.release, "%u.%u", &sys_major_version, &sys_minor_version);
-    sscanf(version, "%u.%u", &req_major_version, &req_minor_version);
-    uint64_t sys_version = sys_major_version * 10000 + sys_minor_version;
-    uint64_t req_version = req_major_version * 10000 + req_minor_version;
-    return sys_version >= req_version;
+
+    free(chunks);
 }
 
-static struct swap_file *create_swap_file(size_t needed_size)
+static struct extent_map *get_extent_map(int fd)
 {
-    log_info("Creating hibernation file at %s with %zu MB.", swap_file_name, needed_size / MEGA_BYTES);
+    struct fiemap query = {
+        .fm_length = FIEMAP_MAX_OFFSET,
+        .fm_flags = FIEMAP_FLAG_SYNC,
+    };
+    struct extent_map *map;
+    struct fiemap *fm;
+    uint32_t blksize;
 
-    if (!create_swap_file_with_size(swap_file_name, needed_size))
-        log_fatal("Could not create swap file, aborting.");
+    if (ioctl(fd, FIGETBSZ, &blksize) < 0) {
+        log_info("Could not get file block size: %s", strerror(errno));
+        return NULL;
+    }
 
-    /* Allocate the swap file with the lowest I/O priority possible to not thrash workload */
-    ioprio_set(IOPRIO_WHO_PROCESS, 0, IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 7));
+    /* With fm_extent_count set to 0, the kernel only counts the extents,
+     * so the whole map can be fetched with a single call afterwards. */
+    if (ioctl(fd, FS_IOC_FIEMAP, &query) < 0) {
+        log_info("Could not map file extents: %s", strerror(errno));
+        return NULL;
+    }
 
-    log_info("Ensuring %s has no holes in it.", swap_file_name);
+    uint32_t batch = query.fm_mapped_extents ? query.fm_mapped_extents : 1;
+    fm = malloc(sizeof(*fm) + batch * sizeof(fm->fm_extents[0]));
+    map = calloc(1, sizeof(*map));
+    if (!fm || !map)
+        log_fatal("Could not allocate memory for extent map");
+
+    map->block_size = blksize;
+    map->smallest = UINT64_MAX;
+
+    /* The file might have changed between both calls, so keep going until
+     * the last extent has been seen. */
+    for (uint64_t start = 0;;) {
+        memset(fm, 0, sizeof(*fm));
+        fm->fm_start = start;
+        fm->fm_length = FIEMAP_MAX_OFFSET - start;
+        fm->fm_flags = FIEMAP_FLAG_SYNC;
+        fm->fm_extent_count = batch;
+
+        if (ioctl(fd, FS_IOC_FIEMAP, fm) < 0) {
+            log_info("Could not map file extents: %s", strerror(errno));
+            free(fm);
+            free(map);
+            return NULL;
+        }
 
-    /* Preallocated swap files are supported on xfs since Linux 4.18. So using fallocate for XFS if system version is higher than 4.18 */
-    bool swap_on_xfs = is_file_on_fs(swap_file_name, XFS_SUPER_MAGIC) && !is_kernel_version_at_least("4.18");
-    if (swap_on_xfs || !try_zeroing_out_with_fallocate(swap_file_name, needed_size)) {
-        if (swap_on_xfs)
-            log_info("Root partition is in a XFS filesystem and kernel version is older than 4.18. Need to use slower method to allocate swap file");
-        else
-            log_info("Fast method failed; trying a slower method.");
+        if (!fm->fm_mapped_extents)
+            break;
 
-        if (!try_zero_out_with_write(swap_file_name, needed_size))
-            log_fatal("Could not create swap file.");
+        map = append_extents(map, fm);
+
+        const struct fiemap_extent *last = &fm->fm_extents[fm->fm_mapped_extents - 1];
+        if (last->fe_flags & FIEMAP_EXTENT_LAST)
+            break;
+        start = last->fe_logical + last->fe_length;
     }
-    perform_fs_specific_checks(swap_file_name);
 
-    spawn_and_wait("mkswap", 1, swap_file_name);
+    free(fm);
 
-    struct swap_file *ret = malloc(sizeof(*ret) + sizeof(swap_file_name));
-    if (!ret)
-        log_fatal("Could not allocate memory to represent a swap file: %s", strerror(errno));
+    if (!map->n_extents)
+        map->smallest = 0;
 
-    ret->capacity = needed_size;
-    memcpy(ret->path, swap_file_name, sizeof(swap_file_name));
-    return ret;
+    struct statfs stfs;
+    if (!fstatfs(fd, &stfs) && stfs.f_type == BTRFS_SUPER_MAGIC)
+        map_btrfs_extents_to_device(fd, map);
+
+    return map;
 }
 
-static bool is_kernel_cmdline_correct(const char *dev_uuid, off_t resume_offset)
+static void log_extent_map(const char *path, const struct extent_map *map)
 {
-    char buffer[1024];
+    log_info("%s has %zu extents in %zu fragments (largest: %" PRIu64 " MB, smallest: %" PRIu64 " kB, average: %" PRIu64 " MB)", path,
+             map->n_extents, map->n_fragments, map->largest / MEGA_BYTES, map->smallest / 1024,
+             map->n_extents ? map->mapped_bytes / map->n_extents / MEGA_BYTES : 0);
+
+    if (map->flags & FIEMAP_EXTENT_UNWRITTEN)
+        log_info("%s has preallocated (unwritten) extents", path);
+    if (map->flags & FIEMAP_EXTENT_SHARED)
+        log_info("%s has extents shared with other files", path);
+    if (map->flags & (FIEMAP_EXTENT_DATA_INLINE | FIEMAP_EXTENT_DATA_TAIL))
+        log_info("%s has data stored inline", path);
+}
 
-    char *line = read_first_line_from_file("/proc/cmdline", buffer);
-    if (!line) {
-        log_info("Could not read /proc/cmdline; is /proc mounted? Assuming information is incorrect.");
-        return false;
-    }
+static uint64_t extent_map_resume_offset(const struct extent_map *map)
+{
+    const uint32_t unusable_flags = FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC | FIEMAP_EXTENT_ENCODED | FIEMAP_EXTENT_DATA_INLINE |
+                                    FIEMAP_EXTENT_DATA_TAIL | FIEMAP_EXTENT_NOT_ALIGNED;
+    const uint64_t page_size = (uint64_t)sysconf(_SC_PAGE_SIZE);
+    uint64_t contiguous = 0;
 
-    char *resume_field = NULL;
-    char *resume_offset_field = NULL;
-    char *no_console_suspend_field = NULL;
-    for (char *field = line; field; field = next_field(field)) {
-        if (!strncmp(field, "resume=", sizeof("resume=") - 1))
-            resume_field = field + sizeof("resume=") - 1;
-        else if (!strncmp(field, "resume_offset=", sizeof("resume_offset=") - 1))
-            resume_offset_field = field + sizeof("resume_offset=") - 1;
-        else if (!strncmp(field, "no_console_suspend=", sizeof("no_console_suspend=") - 1))
-            no_console_suspend_field = field + sizeof("no_console_suspend=") - 1;
-    }
+    /* The kernel reads the swap header from the first page of the file, so
+     * that page has to be backed by contiguous blocks on the device. */
+    for (size_t i = 0; i < map->n_extents && contiguous < page_size; i++) {
+        const struct file_extent *extent = &map->extents[i];
 
-    if (!resume_field)
-        return false;
-    if (!resume_offset_field)
-        return false;
-    if (!no_console_suspend_field)
-        return false;
+        if (extent->logical != contiguous || extent->flags & unusable_flags)
+            break;
+        if (i && extent->physical != map->extents[0].physical + contiguous)
+            break;
 
-    char full_dev_path[PATH_MAX];
-    int r = snprintf(full_dev_path, PATH_MAX, "/dev/disk/by-uuid/%s", dev_uuid);
-    if (r < 0 || r >= PATH_MAX)
-        return false;
-    if (strcmp(resume_field, full_dev_path) != 0)
-        return false;
+        contiguous += extent->length;
+    }
 
-    char offset_buf[3 * sizeof(size_t)];
-    snprintf(offset_buf, sizeof(offset_buf), "%zd", resume_offset);
-    if (strcmp(offset_buf, resume_offset_field) != 0)
-        return false;
+    log_info("First %" PRIu64 " blocks of %u bytes are contiguous", contiguous / map->block_size, map->block_size);
 
-    if (strcmp(no_console_suspend_field, "1") != 0)
-        return false;
+    if (contiguous < page_size || map->extents[0].physical % page_size)
+        return ~0ull;
 
-    return true;
+    /* resume_offset is expressed in pages. */
+    return map->extents[0].physical / page_size;
 }
 
-static struct resume_swap_area get_swap_area(const struct swap_file *swap)
+static uint64_t get_swap_file_offset(int fd)
 {
-    int fd = open(swap->path, O_RDONLY | O_CLOEXEC);
-    struct stat st;
+    struct extent_map *map = get_extent_map(fd);
 
-    if (fd < 0)
-        log_fatal("Could not open %s: %s", swap->path, strerror(errno));
+    if (!map)
+        log_fatal("Could not determine extents of swap file");
 
-    if (fstat(fd, &st) < 0)
-        log_fatal("Could not stat %s: %s", swap->path, strerror(errno));
+    uint64_t offset = extent_map_resume_offset(map);
+    free(map);
 
-    if (!S_ISREG(st.st_mode))
-        log_fatal("Swap file %s is not a regular file", swap->path);
+    return offset;
+}
 
-    uint32_t offset = get_swap_file_offset(fd);
-    if (offset == ~0u)
-        log_fatal("Could not determine file system block number for %s, or file isn't contiguous", swap->path);
+static struct extent_map *get_extent_map_for_path(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        log_info("Could not open %s: %s", path, strerror(errno));
+        return NULL;
+    }
 
+    struct extent_map *map = get_extent_map(fd);
     close(fd);
 
-    log_info("Swap file %s is at device %ld, offset %d", swap->path, st.st_dev, offset);
+    return map;
+}
 
-    return (struct resume_swap_area){
-        .offset = offset,
-        .dev = st.st_dev,
-    };
+static const struct extent_map *swap_file_extents(struct swap_file *swap)
+{
+    if (!swap->extents) {
+        swap->extents = get_extent_map_for_path(swap->path);
+
+        if (!swap->extents)
+            log_fatal("Could not determine extents of swap file %s", swap->path);
+
+        log_extent_map(swap->path, swap->extents);
+    }
+
+    return swap->extents;
 }
 
-static const char *find_grub_cfg_path(void)
+struct zero_out_job {
+    int fd;
+    int error;
+    off_t start;
+    off_t end;
+    size_t chunk_size;
+    const void *zeroes;
+};
+
+static void *zero_out_worker(void *arg)
 {
-    static const char *possible_paths[] = {"/boot/grub2/grub.cfg", "/boot/grub/grub.cfg", NULL};
+    struct zero_out_job *job = arg;
 
-    for (int i = 0; possible_paths[i]; i++) {
-        if (!access(possible_paths[i], F_OK))
-            return possible_paths[i];
+    for (off_t offset = job->start; offset < job->end;) {
+        size_t len = (size_t)(job->end - offset) < job->chunk_size ? (size_t)(job->end - offset) : job->chunk_size;
+        ssize_t written = pwrite(job->fd, job->zeroes, len, offset);
+
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+
+            job->error = errno;
+            break;
+        }
+        if (written == 0) {
+            /* Shouldn't happen for regular files; don't spin forever. */
+            job->error = EIO;
+            break;
+        }
+
+        offset += written;
     }
 
-    log_info("Could not find GRUB configuration file. Is /boot mounted?");
     return NULL;
 }
 
-static bool is_directory_empty(const char *path)
+static bool zero_out_range(int fd, off_t start, off_t end, size_t chunk_size, unsigned int queue_depth, const void *zeroes)
 {
-    DIR *dir = opendir(path);
-    struct dirent *ent;
-    bool has_file = false;
+    struct zero_out_job jobs[queue_depth];
+    pthread_t threads[queue_depth];
+    unsigned int n_threads = 0;
 
-    if (!dir)
+    if (start >= end)
         return true;
 
-    while ((ent = readdir(dir))) {
-        if (!strcmp(ent->d_name, "."))
-            continue;
-        if (!strcmp(ent->d_name, ".."))
-            continue;
-        has_file = true;
-        break;
+    /* Each worker writes its own contiguous section of the range with one
+     * write in flight; splitting the range this way (rather than handing
+     * out chunks round-robin) keeps the file system from interleaving the
+     * allocations of different workers. */
+    off_t section = (end - start) / queue_depth;
+    section -= section % (off_t)chunk_size;
+    if (section < (off_t)chunk_size)
+        queue_depth = 1;
+
+    for (unsigned int i = 0; i < queue_depth; i++) {
+        jobs[i] = (struct zero_out_job){
+            .fd = fd,
+            .start = start + (off_t)i * section,
+            .end = i == queue_depth - 1 ? end : start + (off_t)(i + 1) * section,
+            .chunk_size = chunk_size,
+            .zeroes = zeroes,
+        };
     }
 
-    closedir(dir);
-
-    return !has_file;
+    for (; n_threads < queue_depth; n_threads++) {
+        if (pthread_create(&threads[n_threads], NULL, zero_out_worker, &jobs[n_threads]) != 0)
+            break;
+    }
+    /* Whatever couldn't be handed to a thread is done here. */
+    for (unsigned int i = n_threads; i < queue_depth; i++)
+        zero_out_worker(&jobs[i]);
+    for (unsigned int i = 0; i < n_threads; i++)
+        pthread_join(threads[i], NULL);
+
+    for (unsigned int i = 0; i < queue_depth; i++) {
+        if (jobs[i].error) {
+            errno = jobs[i].error;
+            return false;
+        }
+    }
+    return true;
 }
 
-static bool update_kernel_cmdline_params_for_grub(
-    const char *dev_uuid, const struct resume_swap_area swap_area, bool has_grubby, bool has_update_grub2, bool has_grub2_mkconfig)
+static bool try_zero_out_with_write(const char *path, off_t start, off_t needed_size)
 {
-    bool ret_value = true;
+    struct timespec begin, end;
+    bool ret = false;
+    void *zeroes;
+    int fd;
 
-    /* Doc:
-     * https://docs.fedoraproject.org/en-US/fedora/rawhide/system-administrators-guide/kernel-module-driver-configuration/Working_with_the_GRUB_2_Boot_Loader/#sec-Making_Persistent_Changes_to_a_GRUB_2_Menu_Using_the_grubby_Tool
-     */
-    log_info("Kernel command line is missing parameters to resume from hibernation.  Trying to patch grub configuration file.");
+    long block_size = determine_block_size_for_root_fs();
+    size_t chunk_size = zero_out_chunk_size - zero_out_chunk_size % (size_t)block_size;
+    if (!chunk_size)
+        chunk_size = (size_t)block_size;
 
-    char *args;
-    if (asprintf(&args, "resume=/dev/disk/by-uuid/%s resume_offset=%lld no_console_suspend=1", dev_uuid, swap_area.offset) < 0) {
-        log_info("Could not allocate memory for kernel argument");
+    if (posix_memalign(&zeroes, (size_t)block_size, chunk_size) != 0) {
+        log_info("Could not allocate buffer to write to %s", path);
         return false;
     }
+    memset(zeroes, 0, chunk_size);
 
-    /* Updating initramfs to include resume config changes in boot process, varies by distro. update-initramfs command works
-     * for Ubuntu, Debian whereas dracut is a tool to build initramfs archives on RHEL, CentOS */
-    if (is_exec_in_path("update-initramfs")) {
-        log_info("Updating initramfs to include resume stuff");
+    /* Direct I/O requires aligned offsets and sizes: write the aligned part
+     * of the range with it, and whatever is left at either end through the
+     * page cache. */
+    off_t direct_start = (start + block_size - 1) / block_size * block_size;
+    off_t direct_end = needed_size / block_size * block_size;
+    if (direct_start > direct_end)
+        direct_start = direct_end = start;
 
-        FILE *conf = fopen("/etc/initramfs-tools/conf.d/resume", "we");
-        if (!conf)
-            log_fatal("Could not open initramfs-tools configuration file: %s", strerror(errno));
+    fd = open(path, O_WRONLY | O_CLOEXEC | O_DIRECT);
+    if (fd < 0) {
+        log_info("Could not open %s for direct I/O (%s); writing through the page cache", path, strerror(errno));
+        direct_start = direct_end = start;
+    } else {
+        log_info("Writing %jd MB to %s in %zu kB chunks with %u writes in flight", (intmax_t)(direct_end - direct_start) / (intmax_t)MEGA_BYTES, path,
+                 chunk_size / 1024, zero_out_queue_depth);
 
-        fprintf(conf, "# Updated automatically by hibernation-setup-tool. Do not modify.\n");
-        fprintf(conf, "RESUME=UUID=%s\n", dev_uuid);
-        fclose(conf);
-        spawn_and_wait("update-initramfs", 1, "-u");
-    } else if (is_exec_in_path("dracut")) {
-        log_info("Updating initramfs(dracut) to include resume stuff");
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        bool written = zero_out_range(fd, direct_start, direct_end, chunk_size, zero_out_queue_depth, zeroes);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        close(fd);
 
-        FILE *conf = fopen("/etc/dracut.conf.d/resume.conf", "we");
-        if (!conf)
-            log_fatal("Could not open initramfs-tools configuration file: %s", strerror(errno));
+        if (!written) {
+            log_info("Could not write to %s: %s", path, strerror(errno));
+            goto out;
+        }
 
-        fprintf(conf, "# Updated automatically by hibernation-setup-tool. Do not modify.\n");
-        fprintf(conf, "add_dracutmodules+=\" resume \"");
-        fclose(conf);
-        spawn_and_wait("dracut", 1, "-f");
+        int64_t elapsed_msec = (end.tv_sec - begin.tv_sec) * 1000 + (end.tv_nsec - begin.tv_nsec) / 1000000;
+        if (elapsed_msec > 0) {
+            log_info("Wrote %jd MB in %" PRId64 " ms (%jd MB/s)", (intmax_t)(direct_end - direct_start) / (intmax_t)MEGA_BYTES, elapsed_msec,
+                     (intmax_t)((direct_end - direct_start) / (intmax_t)MEGA_BYTES * 1000 / elapsed_msec));
+        }
     }
 
-    if (has_grubby) {
-        log_info("Using grubby to patch GRUB configuration");
-        spawn_and_wait("grubby", 3, "--update-kernel=ALL", "--args", args);
-    } else if (has_update_grub2 || has_grub2_mkconfig) {
-        FILE *resume_cfg;
-        char *old_contents = NULL;
-        const char *grub_cfg_path;
-        size_t old_contents_len = 0;
-        char buffer[1024];
+    fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        log_info("Could not open %s: %s", path, strerror(errno));
+        goto out;
+    }
 
-        if (!is_directory_empty("/etc/default/grub.d")) {
-            /* If we find this directory, it might be possible that some of the configuration
-             * files there will override GRUB_CMDLINE_LINUX_DEFAULT.  This seems to be the case
-             * in some Azure Marketplace images, with files such as "50-cloudimg-settings.cfg".
-             * If we find the directory, assume we can create our own with higher priority
-             * instead of modifying the global configuration file. */
-            grub_cfg_path = "/etc/default/grub.d/99-hibernate-settings.cfg";
-        } else if (!access("/etc/default/grub", F_OK)) {
-            grub_cfg_path = "/etc/default/grub";
+    if (!zero_out_range(fd, start, direct_start, chunk_size, 1, zeroes) || !zero_out_range(fd, direct_end, needed_size, chunk_size, zero_out_queue_depth, zeroes)) {
+        log_info("Could not write to %s: %s", path, strerror(errno));
+        close(fd);
+        goto out;
+    }
+
+    fdatasync(fd);
+    close(fd);
+    ret = true;
+
+out:
+    free(zeroes);
+    return ret;
+}
+
+static bool fs_set_flags(int fd, int flags_to_set, int flags_to_reset)
+{
+    int current_flags;
+
+    if (ioctl(fd, FS_IOC_GETFLAGS, &current_flags) < 0)
+        return false;
+
+    current_flags |= flags_to_set;
+    current_flags &= ~flags_to_reset;
+
+    if (ioctl(fd, FS_IOC_SETFLAGS, &current_flags) < 0)
+        return false;
+
+    return true;
+}
+
+static bool is_file_on_fs(const char *path, __fsword_t magic)
+{
+    struct statfs stfs;
+
+    if (!statfs(path, &stfs))
+        return stfs.f_type == magic;
+
+    return false;
+}
+
+static void set_xfs_extent_size_hint(int fd, const char *path)
+{
+    struct fsxattr fsx;
+    struct stat st;
+
+    if (!xfs_extent_size_hint)
+        return;
+
+    /* The hint can only be changed before anything has been allocated. */
+    if (fstat(fd, &st) < 0 || st.st_blocks)
+        return;
+
+    if (ioctl(fd, FS_IOC_FSGETXATTR, &fsx) < 0) {
+        log_info("Could not get extended attributes of %s: %s", path, strerror(errno));
+        return;
+    }
+
+    /* Ask XFS to allocate the file in large, aligned chunks; this keeps the
+     * file contiguous without having to run xfs_fsr afterwards. */
+    fsx.fsx_xflags |= FS_XFLAG_EXTSIZE;
+    fsx.fsx_extsize = (uint32_t)xfs_extent_size_hint;
+
+    if (ioctl(fd, FS_IOC_FSSETXATTR, &fsx) < 0) {
+        log_info("Could not set extent size hint of %zu MB on %s: %s", xfs_extent_size_hint / MEGA_BYTES, path, strerror(errno));
+        return;
+    }
+
+    log_info("Set extent size hint of %zu MB on %s", xfs_extent_size_hint / MEGA_BYTES, path);
+}
+
+static bool create_swap_file_with_size(const char *path, off_t size)
+{
+    int fd = open(path, O_CLOEXEC | O_WRONLY | O_CREAT, 0600);
+    int rc;
+
+    if (fd < 0)
+        return false;
+
+    /* Disabling CoW is necessary on btrfs filesystems, but issue the
+     * ioctl regardless of the filesystem just in case.
+     * More information: https://wiki.archlinux.org/index.php/btrfs#Swap_file
+     */
+    if (!fs_set_flags(fd, FS_NOCOW_FL, 0)) {
+        /* Some filesystems don't support CoW (EXT4 for instance), so don't bother
+         * giving an error message in those cases. */
+        if (errno != EOPNOTSUPP)
+            log_info("Could not disable CoW for %s: %s. Will try setting up swap anyway.", path, strerror(errno));
+    }
+    /* Disable compression, too. */
+    if (!fs_set_flags(fd, FS_NOCOMP_FL, FS_COMPR_FL)) {
+        /* Compression is optional, too, so don't bother giving an error message in
+         * case the filesystem doesn't support it. */
+        if (errno != EOPNOTSUPP)
+            log_info("Could not disable compression for %s: %s. Will try setting up swap anyway.", path, strerror(errno));
+    }
+
+    if (is_file_on_fs(path, XFS_SUPER_MAGIC)) {
+        set_xfs_extent_size_hint(fd, path);
+        rc = 0;
+    } else {
+        rc = ftruncate(fd, size);
+        if (rc < 0) {
+            if (errno == EPERM) {
+                log_info("Not enough disk space to create %s with %zu MB.", path, size / MEGA_BYTES);
+            } else {
+                log_info("Could not resize %s to %ld MB: %s", path, size / MEGA_BYTES, strerror(errno));
+            }
+        }
+    }
+
+    close(fd);
+
+    return rc == 0;
+}
+
+bool is_kernel_version_at_least(const char *version)
+{
+    struct utsname my_uname;
+    if (uname(&my_uname) == -1) {
+        log_info("uname call failed.");
+        return true;
+    }
+    unsigned sys_major_version = 0, sys_minor_version = 0;
+    unsigned req_major_version = 0, req_minor_version = 0;
+    sscanf(my_uname.release, "%u.%u", &sys_major_version, &sys_minor_version);
+    sscanf(version, "%u.%u", &req_major_version, &req_minor_version);
+    uint64_t sys_version = sys_major_version * 10000 + sys_minor_version;
+    uint64_t req_version = req_major_version * 10000 + req_minor_version;
+    return sys_version >= req_version;
+}
+
+static void ensure_btrfs_can_hold_swap_file(const char *path)
+{
+    struct btrfs_ioctl_fs_info_args fs_info = {0};
+    struct btrfs_ioctl_space_args query = {0};
+    struct btrfs_ioctl_space_args *spaces;
+    int fd;
+
+    if (!is_kernel_version_at_least("5.0"))
+        log_fatal("Swap files are not supported on Btrfs before kernel 5.0");
+
+    fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        log_fatal("Could not open %s: %s", path, strerror(errno));
+
+    if (ioctl(fd, BTRFS_IOC_FS_INFO, &fs_info) < 0)
+        log_fatal("Could not get Btrfs file system information for %s: %s", path, strerror(errno));
+    if (fs_info.num_devices != 1)
+        log_fatal("Btrfs file system at %s spans %" PRIu64 " devices, but swap files can only be on a single device", path,
+                  (uint64_t)fs_info.num_devices);
+
+    /* With space_slots set to 0, the kernel only counts the block group
+     * types. */
+    if (ioctl(fd, BTRFS_IOC_SPACE_INFO, &query) < 0)
+        log_fatal("Could not get Btrfs space information for %s: %s", path, strerror(errno));
+
+    spaces = calloc(1, sizeof(*spaces) + query.total_spaces * sizeof(spaces->spaces[0]));
+    if (!spaces)
+        log_fatal("Could not allocate memory for Btrfs space information");
+
+    spaces->space_slots = query.total_spaces;
+    if (ioctl(fd, BTRFS_IOC_SPACE_INFO, spaces) < 0)
+        log_fatal("Could not get Btrfs space information for %s: %s", path, strerror(errno));
+
+    close(fd);
+
+    for (uint64_t i = 0; i < spaces->total_spaces; i++) {
+        const struct btrfs_ioctl_space_info *space = &spaces->spaces[i];
+
+        if (!(space->flags & BTRFS_BLOCK_GROUP_DATA))
+            continue;
+        if (space->flags & BTRFS_BLOCK_GROUP_PROFILE_MASK)
+            log_fatal("Btrfs file system at %s doesn't use the single profile for data, which swap files require", path);
+    }
+
+    free(spaces);
+}
+
+static void ensure_btrfs_swap_subvolume(void)
+{
+    struct btrfs_ioctl_vol_args args = {0};
+    struct stat st;
+    int fd;
+
+    if (!stat(btrfs_swap_subvolume, &st)) {
+        if (!S_ISDIR(st.st_mode))
+            log_fatal("%s exists but isn't a directory", btrfs_swap_subvolume);
+        /* The root directory of every subvolume has this inode number. */
+        if (st.st_ino != BTRFS_FIRST_FREE_OBJECTID)
+            log_info("%s is a directory rather than a subvolume; using it anyway", btrfs_swap_subvolume);
+        return;
+    }
+    if (errno != ENOENT)
+        log_fatal("Could not stat %s: %s", btrfs_swap_subvolume, strerror(errno));
+
+    fd = open("/", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        log_fatal("Could not open /: %s", strerror(errno));
+
+    snprintf(args.name, sizeof(args.name), "%s", btrfs_swap_subvolume + 1);
+    if (ioctl(fd, BTRFS_IOC_SUBVOL_CREATE, &args) < 0)
+        log_fatal("Could not create Btrfs subvolume %s: %s", btrfs_swap_subvolume, strerror(errno));
+
+    close(fd);
+
+    if (chmod(btrfs_swap_subvolume, 0700) < 0)
+        log_info("Could not change permissions of %s: %s", btrfs_swap_subvolume, strerror(errno));
+
+    /* Files created in a NOCOW directory inherit the flag. */
+    fd = open(btrfs_swap_subvolume, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0 || !fs_set_flags(fd, FS_NOCOW_FL, 0))
+        log_info("Could not disable CoW for %s: %s", btrfs_swap_subvolume, strerror(errno));
+    if (fd >= 0)
+        close(fd);
+
+    log_info("Created Btrfs subvolume %s for the hibernation file", btrfs_swap_subvolume);
+}
+
+static void select_swap_file_location(void)
+{
+    struct stat st;
+
+    if (!is_file_on_fs("/", BTRFS_SUPER_MAGIC))
+        return;
+
+    /* Check this before anything is created, rather than finding out when
+     * the kernel refuses to enable the swap file. */
+    ensure_btrfs_can_hold_swap_file("/");
+
+    /* Keep using a hibernation file created before the subvolume was. */
+    if (!stat(swap_file_name, &st)) {
+        log_info("Using existing hibernation file %s on Btrfs", swap_file_name);
+        return;
+    }
+
+    /* The subvolume is only created along with the file. */
+    btrfs_swap_subvolume_selected = true;
+
+    snprintf(swap_file_name, sizeof(swap_file_name), "%s/hibfile.sys", btrfs_swap_subvolume);
+    snprintf(swap_file_name_new, sizeof(swap_file_name_new), "%s/hibfile.sys.new", btrfs_swap_subvolume);
+    snprintf(swap_file_name_old, sizeof(swap_file_name_old), "%s/hibfile.sys.old", btrfs_swap_subvolume);
+}
+
+static bool load_allocation_state(struct allocation_state *state)
+{
+    char buffer[PATH_MAX + 64];
+    FILE *f;
+
+    f = fopen(allocation_state_path, "re");
+    if (!f)
+        return false;
+
+    memset(state, 0, sizeof(*state));
+    while (fgets(buffer, sizeof(buffer), f)) {
+        char *key, *value;
+
+        if (!parse_state_line(buffer, &key, &value))
+            continue;
+
+        if (!strcmp(key, "path"))
+            snprintf(state->path, sizeof(state->path), "%s", value);
+        else if (!strcmp(key, "inode"))
+            state->inode = strtoull(value, NULL, 10);
+        else if (!strcmp(key, "size"))
+            state->size = strtoull(value, NULL, 10);
+        else if (!strcmp(key, "allocated"))
+            state->allocated = strtoull(value, NULL, 10);
+        else if (!strcmp(key, "phase"))
+            state->phase = (enum allocation_phase)strtoul(value, NULL, 10);
+    }
+
+    fclose(f);
+
+    return state->path[0] && state->size && state->phase <= ALLOCATION_DEFRAGMENTED;
+}
+
+static void save_allocation_state(const struct allocation_state *state)
+{
+    char *contents;
+
+    if (asprintf(&contents, "path=%s\ninode=%" PRIu64 "\nsize=%" PRIu64 "\nallocated=%" PRIu64 "\nphase=%d\n", state->path, state->inode, state->size,
+                 state->allocated, state->phase) < 0)
+        log_fatal("Could not allocate memory for allocation state");
+
+    if (!ensure_state_dir() || !write_file_atomically(allocation_state_path, contents, 0600))
+        log_info("Could not record allocation progress; an interrupted allocation will start over");
+
+    free(contents);
+}
+
+static void clear_allocation_state(void)
+{
+    if (unlink(allocation_state_path) < 0 && errno != ENOENT)
+        log_info("Could not remove %s: %s", allocation_state_path, strerror(errno));
+}
+
+static uint64_t extent_map_allocated_prefix(const struct extent_map *map)
+{
+    uint64_t end = 0;
+
+    for (size_t i = 0; i < map->n_extents; i++) {
+        const struct file_extent *extent = &map->extents[i];
+
+        if (extent->logical > end)
+            break;
+        if (extent->logical + extent->length > end)
+            end = extent->logical + extent->length;
+    }
+
+    return end;
+}
+
+static bool find_resumable_allocation(const char *path, size_t size, struct allocation_state *state)
+{
+    struct stat st;
+
+    if (!load_allocation_state(state))
+        return false;
+
+    /* A size of 0 matches allocations of any size. */
+    if (strcmp(state->path, path) != 0 || (size && state->size != size))
+        return false;
+    if (stat(path, &st) < 0 || st.st_ino != state->inode)
+        return false;
+
+    if (state->phase == ALLOCATION_IN_PROGRESS) {
+        /* Don't take the recorded progress for granted: check that the
+         * file really has no holes up to that point. */
+        struct extent_map *map = get_extent_map_for_path(path);
+
+        if (!map)
+            return false;
+
+        uint64_t prefix = extent_map_allocated_prefix(map);
+        free(map);
+
+        if (prefix < state->allocated) {
+            log_info("Only the first %" PRIu64 " MB of %s are allocated, not %" PRIu64 " MB", prefix / MEGA_BYTES, path, state->allocated / MEGA_BYTES);
+            state->allocated = prefix;
+        }
+    }
+
+    return true;
+}
+
+static bool is_swap_file_allocation_pending(const char *path, size_t size, size_t *allocated)
+{
+    struct allocation_state state;
+
+    if (!find_resumable_allocation(path, size, &state))
+        return false;
+
+    if (allocated)
+        *allocated = state.phase == ALLOCATION_IN_PROGRESS ? state.allocated : size;
+    return true;
+}
+
+static bool try_zeroing_out_with_fallocate(const char *path, off_t start, off_t end)
+{
+    int fd = open(path, O_CLOEXEC | O_WRONLY);
+
+    if (fd < 0) {
+        log_info("Could not open %s for writing: %s", path, strerror(errno));
+        return false;
+    }
+
+    if (fallocate(fd, 0, start, end - start) < 0) {
+        int fallocate_errno = errno; 
+
+        close(fd);
+
+        if (fallocate_errno == EOPNOTSUPP)
+            return false;
+
+        if (unlink(path) < 0)
+            log_info("Couldn't remove incomplete hibernation file %s: %s", path, strerror(errno));
+        clear_allocation_state();
+
+        if (fallocate_errno == ENOSPC) {
+            log_fatal("System ran out of disk space while allocating hibernation file. It needs %jd MiB", (intmax_t)end / (intmax_t)MEGA_BYTES);
         } else {
-            log_fatal("Could not determine where the Grub configuration file is");
+            log_fatal("Could not allocate %s: %s", path, strerror(fallocate_errno));
         }
+    }
 
-        resume_cfg = fopen(grub_cfg_path, "re");
-        if (resume_cfg) {
-            bool in_az_hibernate_agent_block = false;
-            while (fgets(buffer, sizeof(buffer), resume_cfg)) {
-                if (in_az_hibernate_agent_block) {
-                    if (strstr(buffer, "# hibernation-setup-tool:end"))
-                        in_az_hibernate_agent_block = false;
-                    continue;
-                }
+    /* Make sure the allocation is on disk before it's recorded as done. */
+    fsync(fd);
+    close(fd);
+
+    return true;
+}
+
+static void allocate_swap_file(const char *path, struct allocation_state *state)
+{
+    /* Preallocated swap files are supported on xfs since Linux 4.18. So using fallocate for XFS if system version is higher than 4.18 */
+    bool use_fallocate = !(is_file_on_fs(path, XFS_SUPER_MAGIC) && !is_kernel_version_at_least("4.18"));
+
+    if (!use_fallocate)
+        log_info("Root partition is in a XFS filesystem and kernel version is older than 4.18. Need to use slower method to allocate swap file");
+
+    while (state->allocated < state->size) {
+        uint64_t end = state->allocated + ALLOCATION_CHECKPOINT_SIZE;
+
+        if (end > state->size)
+            end = state->size;
+
+        if (use_fallocate && !try_zeroing_out_with_fallocate(path, (off_t)state->allocated, (off_t)end)) {
+            log_info("Fast method failed; trying a slower method.");
+            use_fallocate = false;
+        }
+        if (!use_fallocate && !try_zero_out_with_write(path, (off_t)state->allocated, (off_t)end))
+            log_fatal("Could not create swap file.");
+
+        state->allocated = end;
+        save_allocation_state(state);
+    }
+}
+
+static bool wait_for_child(const char *program, pid_t pid, unsigned int timeout_secs, int *wstatus, struct rusage *usage)
+{
+    if (timeout_secs) {
+        struct timespec start, now;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (;;) {
+            pid_t waited = wait4(pid, wstatus, WNOHANG, usage);
+
+            if (waited == pid)
+                return true;
+            if (waited < 0) {
+                log_info("Couldn't wait for %s: %s", program, strerror(errno));
+                return false;
+            }
+
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (now.tv_sec - start.tv_sec >= timeout_secs) {
+                log_info("%s (pid %d) is taking longer than %u seconds; stopping it", program, pid, timeout_secs);
+                kill(pid, SIGTERM);
+                wait4(pid, wstatus, 0, usage);
+                return false;
+            }
+
+            usleep(100000);
+        }
+    }
+
+    if (wait4(pid, wstatus, 0, usage) != pid) {
+        log_info("Couldn't wait for %s: %s", program, strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+static bool try_vspawn_and_wait(const char *program, unsigned int timeout_secs, int n_args, va_list ap)
+{
+    pid_t pid;
+    int rc;
+    char **argv;
+
+    argv = calloc(n_args + 2, sizeof(char *));
+    if (!argv) {
+        log_info("Couldn't allocate memory for argument array");
+        return false;
+    }
+
+    argv[0] = (char *)program;
+    for (int i = 1; i <= n_args; i++)
+        argv[i] = va_arg(ap, char *);
+
+    int64_t start_usec = monotonic_usec();
+    rc = posix_spawnp(&pid, program, NULL, NULL, argv, NULL);
+
+    if (rc != 0) {
+        log_info("Could not spawn %s: %s", program, strerror(rc));
+        free(argv);
+        return false;
+    }
+
+    log_info("Waiting for %s (pid %d) to finish.", program, pid);
+
+    struct rusage usage;
+    int wstatus = 0;
+    bool waited = wait_for_child(program, pid, timeout_secs, &wstatus, &usage);
+
+    trace_child(argv, start_usec, wstatus, waited ? &usage : NULL);
+    free(argv);
+
+    if (!waited)
+        return false;
+    if (!WIFEXITED(wstatus)) {
+        log_info("%s ended abnormally: %s", program, strerror(errno));
+        return false;
+    }
+    if (WEXITSTATUS(wstatus) == 127) {
+        log_info("Failed to spawn %s", program);
+        return false;
+    }
+    if (WEXITSTATUS(wstatus) != 0) {
+        log_info("%s ended with unexpected exit code %d", program, WEXITSTATUS(wstatus));
+        return false;
+    }
+
+    log_info("%s finished successfully.", program);
+    return true;
+}
+
+static bool try_spawn_and_wait_with_timeout(const char *program, unsigned int timeout_secs, int n_args, ...)
+{
+    va_list ap;
+    bool spawned;
+
+    va_start(ap, n_args);
+    spawned = try_vspawn_and_wait(program, timeout_secs, n_args, ap);
+    va_end(ap);
+
+    return spawned;
+}
+
+static void spawn_and_wait(const char *program, int n_args, ...)
+{
+    va_list ap;
+    bool spawned;
+
+    va_start(ap, n_args);
+    spawned = try_vspawn_and_wait(program, 0, n_args, ap);
+    va_end(ap);
+
+    if (!spawned)
+        log_fatal("Aborting program due to error condition when spawning %s", program);
+}
+
+static bool is_defrag_worthwhile(const char *path, const struct extent_map *map)
+{
+    if (!map->n_fragments || !map->mapped_bytes)
+        return false;
+
+    /* Streaming the file at the assumed throughput vs. paying an extra I/O
+     * request for every discontiguous fragment, in tenths of a percent. */
+    uint64_t streaming_usec = map->mapped_bytes / (DEFRAG_ASSUMED_THROUGHPUT / 1000000);
+    uint64_t fragment_usec = (uint64_t)(map->n_fragments - 1) * DEFRAG_FRAGMENT_COST_USEC;
+    uint64_t penalty = streaming_usec ? fragment_usec * 1000 / streaming_usec : 0;
+
+    log_info("%s has %zu fragments averaging %" PRIu64 " MB; estimated hibernation throughput penalty is %" PRIu64 ".%" PRIu64 "%%", path,
+             map->n_fragments, map->mapped_bytes / map->n_fragments / MEGA_BYTES, penalty / 10, penalty % 10);
+
+    if (penalty < defrag_threshold_pct * 10) {
+        log_info("Penalty is below the %u%% threshold; not defragmenting %s", defrag_threshold_pct, path);
+        return false;
+    }
+
+    return true;
+}
+
+static bool move_ext4_range(int orig_fd, int donor_fd, uint32_t block_size, uint64_t start, uint64_t length, size_t n_fragments, bool *moved)
+{
+    bool ret = true;
+
+    *moved = false;
+
+    /* Let the allocator find new space for this range in the donor file, and
+     * only swap it in if it's less fragmented than what we have. */
+    if (fallocate(donor_fd, 0, (off_t)start, (off_t)length) < 0) {
+        log_info("Could not allocate %" PRIu64 " MB for donor file: %s", length / MEGA_BYTES, strerror(errno));
+        return false;
+    }
+
+    struct extent_map *donor_map = get_extent_map(donor_fd);
+    if (donor_map && donor_map->n_fragments < n_fragments) {
+        struct move_extent me = {
+            .donor_fd = (uint32_t)donor_fd,
+            .orig_start = start / block_size,
+            .donor_start = start / block_size,
+            .len = length / block_size,
+        };
+
+        while (me.len) {
+            me.moved_len = 0;
+
+            if (ioctl(orig_fd, EXT4_IOC_MOVE_EXT, &me) < 0) {
+                log_info("Could not move extents at offset %" PRIu64 " MB: %s", (me.orig_start * block_size) / MEGA_BYTES, strerror(errno));
+                ret = false;
+                break;
+            }
+            if (!me.moved_len)
+                break;
+
+            me.orig_start += me.moved_len;
+            me.donor_start += me.moved_len;
+            me.len -= me.moved_len;
+            *moved = true;
+        }
+    }
+    free(donor_map);
+
+    /* The donor now holds the old blocks (or the ones we didn't want);
+     * release them before the next range. */
+    if (ftruncate(donor_fd, 0) < 0)
+        log_info("Could not truncate donor file: %s", strerror(errno));
+
+    return ret;
+}
+
+static bool defragment_ext4_file(const char *path, const struct extent_map *map)
+{
+    char dir[PATH_MAX];
+    const char *slash = strrchr(path, '/');
+    int orig_fd, donor_fd;
+
+    if (!slash || slash - path >= PATH_MAX - 1)
+        return false;
+    if (slash == path)
+        strcpy(dir, "/");
+    else
+        snprintf(dir, sizeof(dir), "%.*s", (int)(slash - path), path);
+
+    orig_fd = open(path, O_RDWR | O_CLOEXEC);
+    if (orig_fd < 0) {
+        log_info("Could not open %s for defragmentation: %s", path, strerror(errno));
+        return false;
+    }
+
+    /* The donor has to live in the same file system; an unnamed temporary
+     * file goes away on its own if we're interrupted. */
+    donor_fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (donor_fd < 0) {
+        log_info("Could not create donor file in %s: %s", dir, strerror(errno));
+        close(orig_fd);
+        return false;
+    }
+
+    struct timespec start, now;
+    uint64_t range_start = 0, range_length = 0, moved_bytes = 0;
+    size_t range_fragments = 0, n_ranges = 0;
+    bool ret = true;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    /* Walk the fragments of the file (plus a sentinel at the end), and
+     * rewrite every run of small fragments as a single range. */
+    for (size_t i = 0; i <= map->n_extents && ret;) {
+        uint64_t frag_start = 0, frag_length = 0;
+
+        if (i < map->n_extents) {
+            frag_start = map->extents[i].logical;
+            frag_length = map->extents[i].length;
+
+            for (i++; i < map->n_extents; i++) {
+                const struct file_extent *prev = &map->extents[i - 1];
+                const struct file_extent *cur = &map->extents[i];
+
+                if (cur->logical != prev->logical + prev->length || cur->physical != prev->physical + prev->length)
+                    break;
+                frag_length += cur->length;
+            }
+        } else {
+            i++;
+        }
+
+        bool is_small = frag_length && frag_length < DEFRAG_LARGE_FRAGMENT;
+        bool extends_range = is_small && range_fragments && frag_start == range_start + range_length && range_length + frag_length <= DEFRAG_MAX_RANGE;
+
+        if (extends_range) {
+            range_length += frag_length;
+            range_fragments++;
+            continue;
+        }
+
+        if (range_fragments > 1) {
+            bool moved;
+
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (defrag_budget_secs && now.tv_sec - start.tv_sec >= defrag_budget_secs) {
+                log_info("Defragmentation time budget of %u seconds exhausted", defrag_budget_secs);
+                break;
+            }
+            if (defrag_io_budget && moved_bytes + range_length > defrag_io_budget) {
+                log_info("Defragmentation I/O budget of %zu MB exhausted", defrag_io_budget / MEGA_BYTES);
+                break;
+            }
+
+            ret = move_ext4_range(orig_fd, donor_fd, map->block_size, range_start, range_length, range_fragments, &moved);
+            if (moved) {
+                moved_bytes += range_length;
+                n_ranges++;
+            }
+        }
+
+        range_start = frag_start;
+        range_length = is_small ? frag_length : 0;
+        range_fragments = is_small ? 1 : 0;
+    }
+
+    close(donor_fd);
+    fsync(orig_fd);
+    close(orig_fd);
+
+    log_info("Rewrote %zu fragmented ranges (%" PRIu64 " MB) of %s", n_ranges, moved_bytes / MEGA_BYTES, path);
+
+    /* Report success if anything was done, so e4defrag isn't run on top of it. */
+    return ret || n_ranges;
+}
+
+static void perform_fs_specific_checks(const char *path)
+{
+    /* Not performing defragmentation for xfs file systems as xfs_fsr process is taking time for SKUs with larger RAM.
+       While it is good to have optimization, not ideal to have performance hit on the tool */
+
+    /* Btrfs files are created NOCOW in a fresh subvolume and fully
+     * allocated with fallocate(), so there's nothing to gain from running
+     * "btrfs filesystem defragment" on them. */
+    if (!is_file_on_fs(path, EXT4_SUPER_MAGIC))
+        return;
+
+    struct extent_map *before = get_extent_map_for_path(path);
+    if (!before)
+        return;
+
+    if (!is_defrag_worthwhile(path, before)) {
+        free(before);
+        return;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    /* Only rewrite the fragmented parts of the file ourselves; fall back
+     * to e4defrag if the kernel doesn't let us, with whatever is left of
+     * the time budget. */
+    if (!defragment_ext4_file(path, before) && is_exec_in_path("e4defrag")) {
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        time_t elapsed = end.tv_sec - start.tv_sec;
+        if (!defrag_budget_secs)
+            try_spawn_and_wait_with_timeout("e4defrag", 0, 1, path);
+        else if (elapsed < (time_t)defrag_budget_secs)
+            try_spawn_and_wait_with_timeout("e4defrag", defrag_budget_secs - (unsigned int)elapsed, 1, path);
+        else
+            log_info("Defragmentation time budget of %u seconds exhausted; not running e4defrag", defrag_budget_secs);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    struct extent_map *after = get_extent_map_for_path(path);
+    if (after) {
+        log_info("Defragmenting %s took %ld seconds: %zu fragments before, %zu after", path, (long)(end.tv_sec - start.tv_sec), before->n_fragments,
+                 after->n_fragments);
+        free(after);
+    }
+
+    free(before);
+}
+
+static bool has_valid_swap_signature(int fd, off_t size)
+{
+    long page_size = sysconf(_SC_PAGE_SIZE);
+    char page[page_size];
+    struct swap_header header;
+
+    if (pread(fd, page, (size_t)page_size, 0) != page_size)
+        return false;
+
+    if (memcmp(page + page_size - SWAP_MAGIC_LEN, SWAP_MAGIC, SWAP_MAGIC_LEN) != 0)
+        return false;
+
+    memcpy(&header, page, sizeof(header));
+
+    return header.version == 1 && header.last_page == (uint32_t)(size / page_size - 1);
+}
+
+static void write_swap_header(const char *path)
+{
+    long page_size = sysconf(_SC_PAGE_SIZE);
+    struct swap_header *header;
+    struct stat st;
+    void *page;
+    int fd;
+
+    fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0)
+        log_fatal("Could not open %s to write swap header: %s", path, strerror(errno));
+    if (fstat(fd, &st) < 0)
+        log_fatal("Could not stat %s: %s", path, strerror(errno));
+
+    /* Same minimum as mkswap. */
+    if (st.st_size / page_size < 10)
+        log_fatal("%s is too small to be used as a swap file", path);
+
+    if (posix_memalign(&page, (size_t)page_size, (size_t)page_size) != 0)
+        log_fatal("Could not allocate memory for swap header");
+    memset(page, 0, (size_t)page_size);
+
+    header = page;
+    header->version = 1;
+    header->last_page = (uint32_t)(st.st_size / page_size - 1);
+    header->nr_badpages = 0;
+    snprintf(header->volume_name, sizeof(header->volume_name), "%s", swap_volume_name);
+
+    /* Random (version 4) UUID, so the file can be told apart from others. */
+    if (getrandom(header->uuid, sizeof(header->uuid), 0) != sizeof(header->uuid))
+        log_fatal("Could not generate UUID for swap file: %s", strerror(errno));
+    header->uuid[6] = (header->uuid[6] & 0x0f) | 0x40;
+    header->uuid[8] = (header->uuid[8] & 0x3f) | 0x80;
+
+    memcpy((char *)page + page_size - SWAP_MAGIC_LEN, SWAP_MAGIC, SWAP_MAGIC_LEN);
+
+    if (pwrite(fd, page, (size_t)page_size, 0) != page_size)
+        log_fatal("Could not write swap header to %s: %s", path, strerror(errno));
+    if (fsync(fd) < 0)
+        log_fatal("Could not sync swap header to %s: %s", path, strerror(errno));
+
+    close(fd);
+
+    const unsigned char *u = header->uuid;
+    log_info("Wrote swap header to %s: %u pages, label %s, UUID %02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x", path,
+             header->last_page + 1, header->volume_name, u[0], u[1], u[2], u[3], u[4], u[5], u[6], u[7], u[8], u[9], u[10], u[11], u[12], u[13], u[14], u[15]);
+
+    free(page);
+}
+
+static struct swap_file *create_swap_file(const char *path, size_t needed_size)
+{
+    struct allocation_state state;
+
+    if (find_resumable_allocation(path, needed_size, &state)) {
+        log_info("Resuming creation of hibernation file at %s with %zu MB (%" PRIu64 " MB already allocated).", path, needed_size / MEGA_BYTES,
+                 state.allocated / MEGA_BYTES);
+    } else {
+        struct stat st;
+
+        log_info("Creating hibernation file at %s with %zu MB.", path, needed_size / MEGA_BYTES);
+
+        if (btrfs_swap_subvolume_selected)
+            ensure_btrfs_swap_subvolume();
+
+        if (!create_swap_file_with_size(path, needed_size))
+            log_fatal("Could not create swap file, aborting.");
+        if (stat(path, &st) < 0)
+            log_fatal("Could not stat %s: %s", path, strerror(errno));
+
+        state = (struct allocation_state){
+            .inode = st.st_ino,
+            .size = needed_size,
+            .phase = ALLOCATION_IN_PROGRESS,
+        };
+        snprintf(state.path, sizeof(state.path), "%s", path);
+        save_allocation_state(&state);
+    }
+
+    /* Allocate the swap file with the lowest I/O priority possible to not thrash workload */
+    ioprio_set(IOPRIO_WHO_PROCESS, 0, IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 7));
+
+    struct trace_phase phase;
+
+    if (state.phase == ALLOCATION_IN_PROGRESS) {
+        log_info("Ensuring %s has no holes in it.", path);
+        trace_begin(&phase, "allocation");
+        allocate_swap_file(path, &state);
+        trace_end(&phase);
+
+        struct extent_map *map = get_extent_map_for_path(path);
+        if (map) {
+            log_extent_map(path, map);
+            free(map);
+        }
+
+        state.phase = ALLOCATION_ALLOCATED;
+        save_allocation_state(&state);
+    }
+
+    if (state.phase == ALLOCATION_ALLOCATED) {
+        trace_begin(&phase, "defragmentation");
+        perform_fs_specific_checks(path);
+        trace_end(&phase);
+
+        state.phase = ALLOCATION_DEFRAGMENTED;
+        save_allocation_state(&state);
+    }
+
+    trace_begin(&phase, "swap header");
+    write_swap_header(path);
+    trace_end(&phase);
+    clear_allocation_state();
+
+    return new_swap_file(path, needed_size);
+}
+
+static bool is_swap_size_within_tolerance(size_t capacity, size_t needed_size)
+{
+    size_t tolerance = (needed_size / 100) * swap_size_tolerance_pct;
+
+    if (capacity > needed_size)
+        return capacity - needed_size <= tolerance;
+    return needed_size - capacity <= tolerance;
+}
+
+static bool try_resize_swap_file_in_place(struct swap_file *swap, size_t needed_size)
+{
+    size_t used;
+
+    /* Only resize files we created ourselves; anything else found in
+     * /proc/swaps is recreated as before. */
+    if (strcmp(swap->path, swap_file_name) != 0)
+        return false;
+
+    /* Resizing requires disabling the file first.  That's instantaneous for
+     * an idle area, but not for one holding a lot of swapped-out pages:
+     * those are better served by replacing the file instead. */
+    if (get_active_swap_usage(swap->path, NULL, &used) && used > 64 * MEGA_BYTES) {
+        log_info("%s holds %zu MB of swapped-out pages; not resizing it in place", swap->path, used / MEGA_BYTES);
+        return false;
+    }
+
+    if (needed_size > swap->capacity) {
+        size_t free_space = free_device_space();
+
+        if (free_space < needed_size - swap->capacity) {
+            log_info("Growing %s in place needs %zu MB, but only %zu MB are free", swap->path, (needed_size - swap->capacity) / MEGA_BYTES,
+                     free_space / MEGA_BYTES);
+            return false;
+        }
+    }
+
+    log_info("Resizing %s in place from %zu MB to %zu MB", swap->path, swap->capacity / MEGA_BYTES, needed_size / MEGA_BYTES);
+
+    /* The kernel doesn't allow an active swap file to be modified. */
+    if (swapoff(swap->path) < 0) {
+        if (errno != EINVAL) {
+            log_info("Could not disable swap file %s: %s", swap->path, strerror(errno));
+            return false;
+        }
+    }
+
+    int fd = open(swap->path, O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        log_info("Could not open %s: %s", swap->path, strerror(errno));
+        return false;
+    }
+
+    uint64_t old_offset = get_swap_file_offset(fd);
+
+    if (needed_size > swap->capacity) {
+        ioprio_set(IOPRIO_WHO_PROCESS, 0, IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 7));
+
+        bool swap_on_xfs = is_file_on_fs(swap->path, XFS_SUPER_MAGIC) && !is_kernel_version_at_least("4.18");
+        bool grown;
+        if (swap_on_xfs) {
+            grown = ftruncate(fd, needed_size) == 0 && try_zero_out_with_write(swap->path, swap->capacity, needed_size);
+        } else {
+            grown = fallocate(fd, 0, swap->capacity, needed_size - swap->capacity) == 0;
+            if (!grown)
+                log_info("Could not grow %s: %s", swap->path, strerror(errno));
+        }
+
+        if (!grown) {
+            /* Leave the file the way we found it; it'll be recreated. */
+            if (ftruncate(fd, swap->capacity) < 0)
+                log_info("Could not restore size of %s: %s", swap->path, strerror(errno));
+            close(fd);
+            return false;
+        }
+    } else if (ftruncate(fd, needed_size) < 0) {
+        log_info("Could not shrink %s: %s", swap->path, strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    fsync(fd);
+
+    uint64_t new_offset = get_swap_file_offset(fd);
+    close(fd);
+
+    if (new_offset != old_offset)
+        log_info("First block of %s moved from %" PRIu64 " to %" PRIu64 "; boot configuration will be updated", swap->path, old_offset, new_offset);
+    else
+        log_info("Resume offset of %s is unchanged at %" PRIu64, swap->path, new_offset);
+
+    /* The swap header records the size of the area, so it has to be rewritten. */
+    write_swap_header(swap->path);
+
+    swap->capacity = needed_size;
+    free(swap->extents);
+    swap->extents = NULL;
+    return true;
+}
+
+enum swap_file_problem {
+    SWAP_FILE_HAS_HOLES = 1 << 0,
+    SWAP_FILE_HAS_BAD_SIGNATURE = 1 << 1,
+    SWAP_FILE_HAS_SHARED_EXTENTS = 1 << 2,
+    SWAP_FILE_HAS_INLINE_DATA = 1 << 3,
+    SWAP_FILE_HAS_UNMAPPED_EXTENTS = 1 << 4,
+};
+
+/* Problems that can't be fixed without recreating the file. */
+#define SWAP_FILE_UNREPAIRABLE (SWAP_FILE_HAS_SHARED_EXTENTS | SWAP_FILE_HAS_INLINE_DATA | SWAP_FILE_HAS_UNMAPPED_EXTENTS)
+
+static unsigned int find_swap_file_problems(struct swap_file *swap)
+{
+    unsigned int problems = 0;
+    struct stat st;
+    int fd;
+
+    fd = open(swap->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        log_fatal("Could not open %s: %s", swap->path, strerror(errno));
+    if (fstat(fd, &st) < 0)
+        log_fatal("Could not stat %s: %s", swap->path, strerror(errno));
+
+    if (!has_valid_swap_signature(fd, st.st_size) || lseek(fd, 0, SEEK_DATA) != 0)
+        problems |= SWAP_FILE_HAS_BAD_SIGNATURE;
+
+    const struct extent_map *map = swap_file_extents(swap);
+
+    /* If SEEK_HOLE finds nothing before the end of the file, there are no
+     * holes.  Some file systems report preallocated (unwritten) extents as
+     * holes, though, so double check with the extent map in that case. */
+    off_t hole = lseek(fd, 0, SEEK_HOLE);
+    if (hole >= 0 && hole < st.st_size && extent_map_allocated_prefix(map) < (uint64_t)st.st_size)
+        problems |= SWAP_FILE_HAS_HOLES;
+
+    close(fd);
+
+    if (map->flags & FIEMAP_EXTENT_SHARED)
+        problems |= SWAP_FILE_HAS_SHARED_EXTENTS;
+    if (map->flags & (FIEMAP_EXTENT_DATA_INLINE | FIEMAP_EXTENT_DATA_TAIL))
+        problems |= SWAP_FILE_HAS_INLINE_DATA;
+    if (map->flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC | FIEMAP_EXTENT_ENCODED))
+        problems |= SWAP_FILE_HAS_UNMAPPED_EXTENTS;
+
+    return problems;
+}
+
+static bool ensure_swap_file_is_usable(struct swap_file *swap, bool *rewritten)
+{
+    struct timespec start, end;
+
+    *rewritten = false;
+
+    /* The kernel already vetted files that are in use. */
+    if (get_active_swap_usage(swap->path, NULL, NULL))
+        return true;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    unsigned int problems = find_swap_file_problems(swap);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    log_info("Validated %s in %ld us", swap->path, (long)((end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000));
+
+    if (!problems)
+        return true;
+
+    if (problems & SWAP_FILE_HAS_SHARED_EXTENTS)
+        log_info("%s shares extents with other files", swap->path);
+    if (problems & SWAP_FILE_HAS_INLINE_DATA)
+        log_info("%s has data stored inline", swap->path);
+    if (problems & SWAP_FILE_HAS_UNMAPPED_EXTENTS)
+        log_info("%s has extents that aren't mapped to the device", swap->path);
+    if (problems & SWAP_FILE_UNREPAIRABLE)
+        return false;
+
+    if (problems & SWAP_FILE_HAS_HOLES) {
+        log_info("%s has holes; filling them in", swap->path);
+
+        int fd = open(swap->path, O_WRONLY | O_CLOEXEC);
+        if (fd < 0) {
+            log_info("Could not open %s: %s", swap->path, strerror(errno));
+            return false;
+        }
+
+        /* fallocate() leaves blocks that are already allocated alone, so
+         * the resume offset doesn't change. */
+        ioprio_set(IOPRIO_WHO_PROCESS, 0, IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 7));
+        if (fallocate(fd, 0, 0, (off_t)swap->capacity) < 0) {
+            log_info("Could not fill holes in %s: %s", swap->path, strerror(errno));
+            close(fd);
+            return false;
+        }
+        fsync(fd);
+        close(fd);
+
+        free(swap->extents);
+        swap->extents = NULL;
+    }
+
+    if (problems & SWAP_FILE_HAS_BAD_SIGNATURE) {
+        log_info("%s doesn't have a valid swap signature; writing one", swap->path);
+        write_swap_header(swap->path);
+        *rewritten = true;
+    }
+
+    return true;
+}
+
+static bool swapoff_with_progress(const char *path)
+{
+    struct timespec start, now;
+    size_t initial_used = 0;
+    int wstatus;
+    pid_t pid;
+
+    get_active_swap_usage(path, NULL, &initial_used);
+    log_info("Disabling swap file %s (%zu MB in use)", path, initial_used / MEGA_BYTES);
+
+    /* swapoff() blocks until every page has been read back, so do it in a
+     * child process: this lets us report progress, and killing the child
+     * makes the kernel abort the operation and keep the area enabled. */
+    pid = fork();
+    if (pid < 0) {
+        log_info("Could not fork to disable swap file %s: %s", path, strerror(errno));
+        return false;
+    }
+    if (pid == 0)
+        _exit(swapoff(path) < 0 ? errno : 0);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (time_t last_report = 0;;) {
+        pid_t waited = waitpid(pid, &wstatus, WNOHANG);
+
+        if (waited == pid)
+            break;
+        if (waited < 0) {
+            log_info("Couldn't wait for swapoff of %s: %s", path, strerror(errno));
+            return false;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        time_t elapsed = now.tv_sec - start.tv_sec;
+
+        if (swapoff_timeout_secs && elapsed >= swapoff_timeout_secs) {
+            log_info("Disabling %s is taking longer than %u seconds; aborting it", path, swapoff_timeout_secs);
+            kill(pid, SIGKILL);
+            waitpid(pid, &wstatus, 0);
+            return false;
+        }
+
+        if (elapsed - last_report >= 5) {
+            size_t used;
+
+            if (get_active_swap_usage(path, NULL, &used)) {
+                log_info("Draining %s: %zu of %zu MB left after %ld seconds", path, used / MEGA_BYTES, initial_used / MEGA_BYTES, (long)elapsed);
+            }
+            last_report = elapsed;
+        }
+
+        usleep(100000);
+    }
+
+    if (!WIFEXITED(wstatus)) {
+        log_info("Process disabling %s ended abnormally", path);
+        return false;
+    }
+    if (WEXITSTATUS(wstatus) == EINVAL) {
+        log_info("%s is not currently being used as a swap partition. That's OK.", path);
+        return true;
+    }
+    if (WEXITSTATUS(wstatus) != 0) {
+        log_info("Could not disable swap file %s: %s", path, strerror(WEXITSTATUS(wstatus)));
+        return false;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    log_info("Disabled swap file %s in %ld seconds", path, (long)(now.tv_sec - start.tv_sec));
+    return true;
+}
+
+static void retire_swap_file(const char *path)
+{
+    size_t used = 0;
+
+    if (get_active_swap_usage(path, NULL, &used)) {
+        size_t available = meminfo_value("MemAvailable");
+        size_t headroom = physical_memory() / 20;
+
+        /* Pages in the old area have to fit back into memory. If they don't,
+         * leave it enabled: it's not in /etc/fstab anymore, so it'll be gone
+         * after the next boot. */
+        if (available < used + headroom) {
+            log_info("Only %zu MB of memory available to drain %zu MB from %s; leaving it enabled until next boot", available / MEGA_BYTES,
+                     used / MEGA_BYTES, path);
+            return;
+        }
+
+        if (!swapoff_with_progress(path)) {
+            log_info("Leaving %s enabled until next boot", path);
+            return;
+        }
+    }
+
+    if (unlink(path) < 0 && errno != ENOENT)
+        log_info("Could not remove old swap file %s: %s", path, strerror(errno));
+}
+
+static void remove_stale_swap_files(void)
+{
+    static const char *stale_paths[] = {swap_file_name_new, swap_file_name_old, NULL};
+
+    for (int i = 0; stale_paths[i]; i++) {
+        if (access(stale_paths[i], F_OK) < 0)
+            continue;
+
+        if (is_swap_file_allocation_pending(stale_paths[i], 0, NULL))
+            continue;
+
+        if (get_active_swap_usage(stale_paths[i], NULL, NULL)) {
+            log_info("%s from a previous replacement is still enabled; leaving it alone", stale_paths[i]);
+            continue;
+        }
+
+        log_info("Removing %s left behind by a previous replacement", stale_paths[i]);
+        if (unlink(stale_paths[i]) < 0)
+            log_info("Could not remove %s: %s", stale_paths[i], strerror(errno));
+    }
+}
+
+static struct swap_file *replace_swap_file(const struct swap_file *swap, size_t needed_size)
+{
+    size_t free_space = free_device_space();
+
+    /* Both files have to exist at the same time. */
+    if (free_space < needed_size + needed_size / 20) {
+        log_info("Not enough free space to create a new swap file next to %s (%zu MB free)", swap->path, free_space / MEGA_BYTES);
+        return NULL;
+    }
+
+    log_info("Replacing %s with a new %zu MB swap file. The old one stays enabled until the new one is in use.", swap->path, needed_size / MEGA_BYTES);
+
+    struct swap_file *new_swap = create_swap_file(swap_file_name_new, needed_size);
+
+    if (chmod(new_swap->path, 0600) < 0 || swapon(new_swap->path, 0) < 0) {
+        log_info("Could not enable new swap file %s: %s", new_swap->path, strerror(errno));
+        if (unlink(new_swap->path) < 0)
+            log_info("Couldn't remove %s: %s", new_swap->path, strerror(errno));
+        free_swap_file(new_swap);
+        return NULL;
+    }
+
+    /* Active swap files can be renamed; the kernel holds on to the inode. */
+    const char *retired_path = swap->path;
+    if (!strcmp(swap->path, swap_file_name)) {
+        if (rename(swap_file_name, swap_file_name_old) < 0)
+            log_fatal("Could not rename %s to %s: %s", swap_file_name, swap_file_name_old, strerror(errno));
+        retired_path = swap_file_name_old;
+    }
+    if (rename(swap_file_name_new, swap_file_name) < 0)
+        log_fatal("Could not rename %s to %s: %s", swap_file_name_new, swap_file_name, strerror(errno));
+
+    free_swap_file(new_swap);
+
+    retire_swap_file(retired_path);
+
+    return new_swap_file(swap_file_name, needed_size);
+}
+
+static bool is_kernel_cmdline_correct(const char *dev_uuid, off_t resume_offset)
+{
+    char buffer[1024];
+
+    char *line = read_first_line_from_file("/proc/cmdline", buffer);
+    if (!line) {
+        log_info("Could not read /proc/cmdline; is /proc mounted? Assuming information is incorrect.");
+        return false;
+    }
+
+    char *resume_field = NULL;
+    char *resume_offset_field = NULL;
+    char *no_console_suspend_field = NULL;
+    char *compressor_field = NULL;
+    char *compression_threads_field = NULL;
+    for (char *field = line; field; field = next_field(field)) {
+        if (!strncmp(field, "resume=", sizeof("resume=") - 1))
+            resume_field = field + sizeof("resume=") - 1;
+        else if (!strncmp(field, "resume_offset=", sizeof("resume_offset=") - 1))
+            resume_offset_field = field + sizeof("resume_offset=") - 1;
+        else if (!strncmp(field, "no_console_suspend=", sizeof("no_console_suspend=") - 1))
+            no_console_suspend_field = field + sizeof("no_console_suspend=") - 1;
+        else if (!strncmp(field, "hibernate.compressor=", sizeof("hibernate.compressor=") - 1))
+            compressor_field = field + sizeof("hibernate.compressor=") - 1;
+        else if (!strncmp(field, "hibernate_compression_threads=", sizeof("hibernate_compression_threads=") - 1))
+            compression_threads_field = field + sizeof("hibernate_compression_threads=") - 1;
+    }
+
+    if (!resume_field)
+        return false;
+    if (!resume_offset_field)
+        return false;
+    if (!no_console_suspend_field)
+        return false;
+
+    char full_dev_path[PATH_MAX];
+    int r = snprintf(full_dev_path, PATH_MAX, "/dev/disk/by-uuid/%s", dev_uuid);
+    if (r < 0 || r >= PATH_MAX)
+        return false;
+    if (strcmp(resume_field, full_dev_path) != 0)
+        return false;
+
+    char offset_buf[3 * sizeof(size_t)];
+    snprintf(offset_buf, sizeof(offset_buf), "%zd", resume_offset);
+    if (strcmp(offset_buf, resume_offset_field) != 0)
+        return false;
+
+    if (strcmp(no_console_suspend_field, "1") != 0)
+        return false;
+
+    if (hibernation_compressor[0] && (!compressor_field || strcmp(compressor_field, hibernation_compressor) != 0))
+        return false;
+
+    if (hibernation_compression_threads) {
+        if (!compression_threads_field || strtoul(compression_threads_field, NULL, 10) != hibernation_compression_threads)
+            return false;
+    }
+
+    return true;
+}
+
+static struct resume_swap_area get_swap_area(struct swap_file *swap)
+{
+    int fd = open(swap->path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+
+    if (fd < 0)
+        log_fatal("Could not open %s: %s", swap->path, strerror(errno));
+
+    if (fstat(fd, &st) < 0)
+        log_fatal("Could not stat %s: %s", swap->path, strerror(errno));
+
+    if (!S_ISREG(st.st_mode))
+        log_fatal("Swap file %s is not a regular file", swap->path);
+
+    close(fd);
+
+    uint64_t offset = extent_map_resume_offset(swap_file_extents(swap));
+    if (offset == ~0ull)
+        log_fatal("Could not determine file system block number for %s, or file isn't contiguous", swap->path);
+
+    dev_t dev = st.st_dev;
+    if (is_file_on_fs(swap->path, BTRFS_SUPER_MAGIC)) {
+        /* Btrfs reports an anonymous device number in st_dev; the kernel
+         * needs the block device the file system is on. */
+        char source[PATH_MAX];
+        struct stat dev_st;
+
+        if (!find_mount_source_for_path(swap->path, source) || stat(source, &dev_st) < 0 || !S_ISBLK(dev_st.st_mode))
+            log_fatal("Could not determine block device holding %s", swap->path);
+
+        dev = dev_st.st_rdev;
+    }
+
+    log_info("Swap file %s is at device %ld, offset %" PRIu64, swap->path, dev, offset);
+
+    return (struct resume_swap_area){
+        .offset = offset,
+        .dev = dev,
+    };
+}
+
+static const char *find_grub_cfg_path(void)
+{
+    static const char *possible_paths[] = {"/boot/grub2/grub.cfg", "/boot/grub/grub.cfg", NULL};
+
+    for (int i = 0; possible_paths[i]; i++) {
+        if (!access(possible_paths[i], F_OK))
+            return possible_paths[i];
+    }
+
+    log_info("Could not find GRUB configuration file. Is /boot mounted?");
+    return NULL;
+}
+
+static bool is_directory_empty(const char *path)
+{
+    DIR *dir = opendir(path);
+    struct dirent *ent;
+    bool has_file = false;
+
+    if (!dir)
+        return true;
+
+    while ((ent = readdir(dir))) {
+        if (!strcmp(ent->d_name, "."))
+            continue;
+        if (!strcmp(ent->d_name, ".."))
+            continue;
+        has_file = true;
+        break;
+    }
+
+    closedir(dir);
+
+    return !has_file;
+}
+
+static bool update_kernel_cmdline_params_for_grub(
+    const char *dev_uuid, const struct resume_swap_area swap_area, bool has_grubby, bool has_update_grub2, bool has_grub2_mkconfig)
+{
+    bool ret_value = true;
+
+    /* Doc:
+     * https://docs.fedoraproject.org/en-US/fedora/rawhide/system-administrators-guide/kernel-module-driver-configuration/Working_with_the_GRUB_2_Boot_Loader/#sec-Making_Persistent_Changes_to_a_GRUB_2_Menu_Using_the_grubby_Tool
+     */
+    log_info("Kernel command line is missing parameters to resume from hibernation.  Trying to patch grub configuration file.");
+
+    char compressor_args[96] = "";
+    if (hibernation_compressor[0]) {
+        int len = snprintf(compressor_args, sizeof(compressor_args), " hibernate.compressor=%s", hibernation_compressor);
+        if (hibernation_compression_threads)
+            snprintf(compressor_args + len, sizeof(compressor_args) - (size_t)len, " hibernate_compression_threads=%u", hibernation_compression_threads);
+    }
+
+    char *args;
+    if (asprintf(&args, "resume=/dev/disk/by-uuid/%s resume_offset=%lld no_console_suspend=1%s", dev_uuid, swap_area.offset, compressor_args) < 0) {
+        log_info("Could not allocate memory for kernel argument");
+        return false;
+    }
+
+    /* Updating initramfs to include resume config changes in boot process, varies by distro. update-initramfs command works
+     * for Ubuntu, Debian whereas dracut is a tool to build initramfs archives on RHEL, CentOS */
+    if (is_exec_in_path("update-initramfs")) {
+        log_info("Updating initramfs to include resume stuff");
+
+        FILE *conf = fopen("/etc/initramfs-tools/conf.d/resume", "we");
+        if (!conf)
+            log_fatal("Could not open initramfs-tools configuration file: %s", strerror(errno));
+
+        fprintf(conf, "# Updated automatically by hibernation-setup-tool. Do not modify.\n");
+        fprintf(conf, "RESUME=UUID=%s\n", dev_uuid);
+        fclose(conf);
+        spawn_and_wait("update-initramfs", 1, "-u");
+    } else if (is_exec_in_path("dracut")) {
+        log_info("Updating initramfs(dracut) to include resume stuff");
+
+        FILE *conf = fopen("/etc/dracut.conf.d/resume.conf", "we");
+        if (!conf)
+            log_fatal("Could not open initramfs-tools configuration file: %s", strerror(errno));
+
+        fprintf(conf, "# Updated automatically by hibernation-setup-tool. Do not modify.\n");
+        fprintf(conf, "add_dracutmodules+=\" resume \"");
+        fclose(conf);
+        spawn_and_wait("dracut", 1, "-f");
+    }
+
+    if (has_grubby) {
+        log_info("Using grubby to patch GRUB configuration");
+        spawn_and_wait("grubby", 3, "--update-kernel=ALL", "--args", args);
+    } else if (has_update_grub2 || has_grub2_mkconfig) {
+        FILE *resume_cfg;
+        char *old_contents = NULL;
+        const char *grub_cfg_path;
+        size_t old_contents_len = 0;
+        char buffer[1024];
+
+        if (!is_directory_empty("/etc/default/grub.d")) {
+            /* If we find this directory, it might be possible that some of the configuration
+             * files there will override GRUB_CMDLINE_LINUX_DEFAULT.  This seems to be the case
+             * in some Azure Marketplace images, with files such as "50-cloudimg-settings.cfg".
+             * If we find the directory, assume we can create our own with higher priority
+             * instead of modifying the global configuration file. */
+            grub_cfg_path = "/etc/default/grub.d/99-hibernate-settings.cfg";
+        } else if (!access("/etc/default/grub", F_OK)) {
+            grub_cfg_path = "/etc/default/grub";
+        } else {
+            log_fatal("Could not determine where the Grub configuration file is");
+        }
+
+        resume_cfg = fopen(grub_cfg_path, "re");
+        if (resume_cfg) {
+            bool in_az_hibernate_agent_block = false;
+            while (fgets(buffer, sizeof(buffer), resume_cfg)) {
+                if (in_az_hibernate_agent_block) {
+                    if (strstr(buffer, "# hibernation-setup-tool:end"))
+                        in_az_hibernate_agent_block = false;
+                    continue;
+                }
+
+                if (strstr(buffer, "# hibernation-setup-tool:start")) {
+                    in_az_hibernate_agent_block = true;
+                    continue;
+                }
+
+                size_t buflen = strlen(buffer);
+                char *tmp = realloc(old_contents, old_contents_len + buflen + 1);
+                if (!tmp)
+                    log_fatal("Could not allocate memory: %s", strerror(errno));
+
+                memcpy(tmp + old_contents_len, buffer, buflen + 1);
+                old_contents_len += buflen;
+                old_contents = tmp;
+            }
+
+            fclose(resume_cfg);
+        }
+
+        resume_cfg = fopen(grub_cfg_path, "we");
+        if (!resume_cfg)
+            log_fatal("Could not open %s for writing: %s", grub_cfg_path, strerror(errno));
+
+        if (old_contents) {
+            fwrite(old_contents, old_contents_len, 1, resume_cfg);
+            free(old_contents);
+        }
+
+        fprintf(resume_cfg, "\n# hibernation-setup-tool:start\n");
+        fprintf(resume_cfg, "GRUB_CMDLINE_LINUX_DEFAULT=\"$GRUB_CMDLINE_LINUX_DEFAULT %s\"\n", args);
+        fprintf(resume_cfg, "unset GRUB_FORCE_PARTUUID\n");
+        fprintf(resume_cfg, "# hibernation-setup-tool:end\n");
+
+        fclose(resume_cfg);
+
+        if (has_update_grub2) {
+            log_info("Using update-grub2 to patch GRUB configuration in %s", grub_cfg_path);
+            spawn_and_wait("update-grub2", 0);
+        } else if (has_grub2_mkconfig) {
+            const char *grub_cfg_path = find_grub_cfg_path();
+
+            if (!grub_cfg_path) {
+                ret_value = false;
+            } else {
+                log_info("Using grub2-mkconfig to patch GRUB configuration in %s", grub_cfg_path);
+                spawn_and_wait("grub2-mkconfig", 2, "-o", grub_cfg_path);
+            }
+        }
+    }
+
+    free(args);
+
+    return ret_value;
+}
+
+static size_t read_power_parameter(const char *name, size_t default_value)
+{
+    char path[PATH_MAX];
+    char buffer[1024];
+    char *line;
+
+    snprintf(path, sizeof(path), "/sys/power/%s", name);
+    line = read_first_line_from_file(path, buffer);
+    if (!line)
+        return default_value;
+
+    return (size_t)strtoull(line, NULL, 10);
+}
+
+static bool write_power_parameter(const char *name, size_t value)
+{
+    char path[PATH_MAX];
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "/sys/power/%s", name);
+    fp = fopen(path, "we");
+    if (!fp) {
+        log_info("Could not open %s for writing: %s", path, strerror(errno));
+        return false;
+    }
+
+    bool written = fprintf(fp, "%zu\n", value) > 0;
+    if (fclose(fp) != 0 || !written) {
+        log_info("Could not write %zu to %s: %s", value, path, strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+static bool set_resume_swap_area(struct resume_swap_area swap_area)
+{
+    FILE *resume_offset_fp;
+
+    int fd = open("/dev/snapshot", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        log_info("Could not open /dev/snapshot: %s", strerror(errno));
+        return false;
+    }
+
+    if (ioctl(fd, SNAPSHOT_SET_SWAP_AREA, &swap_area) < 0) {
+        log_info("Could not set resume_swap_area parameters in /dev/snapshot: %s", strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    close(fd);
+
+    log_info("Updating /sys/power/resume_offset");
+    resume_offset_fp = fopen("/sys/power/resume_offset", "we");
+    if (!resume_offset_fp)
+            log_fatal("Could not open %s for writing: %s", "/sys/power/resume_offset", strerror(errno));
+    if (fprintf(resume_offset_fp, "%llu\n", (unsigned long long)swap_area.offset) <= 0)
+            log_fatal("Failed to write /sys/power/resume_offset.");
+    if (fclose(resume_offset_fp) != 0)
+            log_fatal("Failed to close /sys/power/resume_offset.");
+    log_set_resume_offset(swap_area.offset);
+    log_info("Wrote %llu to /sys/power/resume_offset successfully.", (unsigned long long)swap_area.offset);
+
+    return true;
+}
+
+static bool update_swap_offset(struct swap_file *swap)
+{
+    bool ret = true;
+
+    log_info("Updating swap offset");
+
+    struct resume_swap_area swap_area = get_swap_area(swap);
+    if (!set_resume_swap_area(swap_area))
+        return false;
+
+    char *dev_uuid = get_disk_uuid_for_file_path(swap->path);
+
+    if (!dev_uuid)
+        log_fatal("Could not determine device UUID for swap file %s", swap->path);
+
+    log_info("Swap file %s is in device UUID %s", swap->path, dev_uuid);
+
+    if (!is_kernel_cmdline_correct(dev_uuid, swap_area.offset)) {
+        log_info("Kernel command-line parameters need updating.");
+
+        bool has_grubby = is_exec_in_path("grubby");
+        bool has_update_grub2 = is_exec_in_path("update-grub2");
+        bool has_grub2_mkconfig = is_exec_in_path("grub2-mkconfig");
+        if (has_grubby || has_update_grub2 || has_grub2_mkconfig) {
+            ret = update_kernel_cmdline_params_for_grub(dev_uuid, swap_area, has_grubby, has_update_grub2, has_grub2_mkconfig);
+        } else {
+            log_info(
+                "Could not determine how system was booted to update kernel parameters for next boot.  System won't be able to resume until you fix this.");
+            ret = false;
+        }
+    }
+
+    free(dev_uuid);
+    return ret;
+}
+
+static void ensure_swap_is_enabled(const struct swap_file *swap, bool created)
+{
+    FILE *fstab;
+    char *old_contents = NULL;
+    size_t old_contents_len = 0;
+    char buffer[1024];
+
+    log_info("Ensuring swap file %s is enabled", swap->path);
+
+    if (chmod(swap->path, 0600) < 0)
+        log_fatal("Couldn't set correct permissions on %s: %s", swap->path, strerror(errno));
+
+    if (swapon(swap->path, 0) < 0) {
+        if (errno == EINVAL && !created)
+            log_fatal("%s exists but kernel isn't accepting it as a swap file. Try removing it and re-running the agent.", swap->path);
+
+        if (errno != EBUSY)
+            log_fatal("Could not enable swap file: %s", strerror(errno));
+    }
+
+    log_info("Updating /etc/fstab");
+
+    fstab = fopen("/etc/fstab", "re");
+    if (!fstab)
+        log_fatal("Could not open fstab: %s", strerror(errno));
+
+    while (fgets(buffer, sizeof(buffer), fstab)) {
+        if (strstr(buffer, swap->path))
+            continue;
+
+        size_t buflen = strlen(buffer);
+        char *tmp = realloc(old_contents, old_contents_len + buflen + 1);
+
+        if (!tmp)
+            log_fatal("Couldn't allocate memory");
+
+        memcpy(tmp + old_contents_len, buffer, buflen + 1);
+        old_contents_len += buflen;
+        old_contents = tmp;
+    }
+
+    fclose(fstab);
+
+    fstab = fopen("/etc/fstab", "we");
+    if (!fstab)
+        log_fatal("Could not open fstab for writing: %s", strerror(errno));
+
+    if (old_contents) {
+        fwrite(old_contents, old_contents_len, 1, fstab);
+        free(old_contents);
+    }
+    fprintf(fstab, "\n%s\tnone\tswap\tswap\t0\t0\n", swap->path);
+
+    fclose(fstab);
+}
+
+static void ensure_udev_rules_are_installed(void)
+{
+    char systemctl_path_buf[PATH_MAX];
+    const char *udev_rule_path;
+    const char *systemctl_path;
+
+    systemctl_path = find_executable_in_path("systemctl", NULL, systemctl_path_buf);
+    if (!systemctl_path) {
+        log_info("systemctl not found or not executable, udev rule won't work");
+        return;
+    }
+    if (!is_exec_in_path("udevadm")) {
+        log_info("udevadm has not been found in $PATH; maybe system doesn't use systemd?");
+        return;
+    }
+
+    if (!access("/usr/lib/udev/rules.d", F_OK)) {
+        udev_rule_path = "/usr/lib/udev/rules.d/99-vm-hibernation.rules";
+    } else if (!access("/etc/udev/rules.d", F_OK)) {
+        udev_rule_path = "/etc/udev/rules.d/99-vm-hibernation.rules";
+    } else if (!access("/lib/udev/rules.d", F_OK)) {
+        udev_rule_path = "/lib/udev/rules.d/99-vm-hibernation.rules";
+    } else {
+        log_info("Couldn't find where udev stores the rules.  VM may not hibernate.");
+        return;
+    }
+
+    FILE *rule_file = fopen(udev_rule_path, "we");
+    if (!rule_file)
+        log_fatal("Could not open '%s' for writing: %s", udev_rule_path, strerror(errno));
+    fprintf(rule_file,
+            "SUBSYSTEM==\"vmbus\", ACTION==\"change\", "
+            "DRIVER==\"hv_utils\", ENV{EVENT}==\"hibernate\", "
+            "RUN+=\"%s hibernate\"\n",
+            systemctl_path);
+    fclose(rule_file);
+
+    log_info("udev rule to hibernate with systemd set up in %s.  Telling udev about it.", udev_rule_path);
+
+    /* This isn't strictly necessary, but do it anyway just in case. */
+    spawn_and_wait("udevadm", 2, "control", "--reload-rules");
+    spawn_and_wait("udevadm", 1, "trigger");
+}
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ull
+#define FNV_PRIME 0x100000001b3ull
+
+static uint64_t fnv1a_hash(uint64_t hash, const void *data, size_t len)
+{
+    const unsigned char *bytes = data;
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+
+    return hash;
+}
+
+static uint64_t hash_file_contents(uint64_t hash, const char *path)
+{
+    char buffer[16384];
+    ssize_t r;
+    int fd;
+
+    hash = fnv1a_hash(hash, path, strlen(path) + 1);
+
+    /* A missing file hashes differently from an empty one. */
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        int error = errno;
+        return fnv1a_hash(hash, &error, sizeof(error));
+    }
+
+    while ((r = read(fd, buffer, sizeof(buffer))) != 0) {
+        if (r < 0) {
+            int error = errno;
+
+            if (error == EINTR)
+                continue;
+            hash = fnv1a_hash(hash, &error, sizeof(error));
+            break;
+        }
+        hash = fnv1a_hash(hash, buffer, (size_t)r);
+    }
+
+    close(fd);
+
+    return hash;
+}
+
+static uint64_t hash_extent_map(const struct extent_map *map)
+{
+    uint64_t hash = FNV_OFFSET_BASIS;
+
+    for (size_t i = 0; i < map->n_extents; i++) {
+        const struct file_extent *extent = &map->extents[i];
+
+        hash = fnv1a_hash(hash, &extent->logical, sizeof(extent->logical));
+        hash = fnv1a_hash(hash, &extent->physical, sizeof(extent->physical));
+        hash = fnv1a_hash(hash, &extent->length, sizeof(extent->length));
+        hash = fnv1a_hash(hash, &extent->flags, sizeof(extent->flags));
+    }
+
+    return hash;
+}
+
+/* Files this tool writes (or reads to decide what to write) outside of the
+ * hibernation file itself.  If any of them changes, something else touched
+ * the configuration and a full run is needed. */
+static const char *const fingerprint_artifacts[] = {
+    "/etc/fstab",
+    "/etc/default/grub",
+    "/etc/default/grub.d/99-hibernate-settings.cfg",
+    "/etc/initramfs-tools/conf.d/resume",
+    "/etc/dracut.conf.d/resume.conf",
+    "/usr/lib/udev/rules.d/99-vm-hibernation.rules",
+    "/etc/udev/rules.d/99-vm-hibernation.rules",
+    "/lib/udev/rules.d/99-vm-hibernation.rules",
+    NULL,
+};
+
+struct configuration_fingerprint {
+    char swap_path[PATH_MAX];
+    char dev_uuid[64];
+    uint64_t mem_total;
+    uint64_t inode;
+    uint64_t dev;
+    uint64_t size;
+    uint64_t extents_hash;
+    uint64_t cmdline_hash;
+    uint64_t artifacts_hash;
+    uint64_t options_hash;
+    uint64_t resume_dev;
+    uint64_t resume_offset;
+    /* Not part of the fingerprint either; restored along with the resume parameters. */
+    uint64_t image_size;
+    /* Hibernation compressor selected, and what it was selected for (empty
+     * without --select-compressor).  Only the CPU count is compared. */
+    char compressor[16];
+    uint64_t compression_threads;
+    uint64_t cpus;
+    uint64_t write_bps;
+    uint64_t read_bps;
+    /* Only used for metrics; not part of the fingerprint. */
+    uint64_t n_extents;
+};
+
+/* Options that change the size of the hibernation file, or the image_size
+ * restored from the fingerprint. */
+static uint64_t hash_sizing_options(void)
+{
+    char options[128];
+    int len = snprintf(options, sizeof(options), "sizing=%d margin=%u tolerance=%u budget=%u", (int)swap_sizing, swap_sizing_margin_pct,
+                       swap_size_tolerance_pct, hibernate_time_budget_secs);
+
+    return fnv1a_hash(FNV_OFFSET_BASIS, options, (size_t)len);
+}
+
+static bool compute_configuration_fingerprint(const char *swap_path, struct configuration_fingerprint *fp)
+{
+    struct stat st;
+
+    if (stat(swap_path, &st) < 0 || !S_ISREG(st.st_mode))
+        return false;
+
+    struct extent_map *map = get_extent_map_for_path(swap_path);
+    if (!map)
+        return false;
+
+    uint64_t artifacts_hash = FNV_OFFSET_BASIS;
+    for (int i = 0; fingerprint_artifacts[i]; i++)
+        artifacts_hash = hash_file_contents(artifacts_hash, fingerprint_artifacts[i]);
+
+    snprintf(fp->swap_path, sizeof(fp->swap_path), "%s", swap_path);
+    fp->mem_total = physical_memory();
+    fp->inode = st.st_ino;
+    fp->dev = st.st_dev;
+    fp->size = (uint64_t)st.st_size;
+    fp->extents_hash = hash_extent_map(map);
+    fp->n_extents = map->n_extents;
+    fp->cmdline_hash = hash_file_contents(FNV_OFFSET_BASIS, "/proc/cmdline");
+    fp->artifacts_hash = artifacts_hash;
+    fp->options_hash = hash_sizing_options();
+
+    free(map);
+
+    return true;
+}
+
+static bool load_configuration_fingerprint(struct configuration_fingerprint *fp)
+{
+    char buffer[PATH_MAX + 64];
+    unsigned int version = 0;
+    FILE *f;
+
+    f = fopen(fingerprint_path, "re");
+    if (!f)
+        return false;
+
+    memset(fp, 0, sizeof(*fp));
+    while (fgets(buffer, sizeof(buffer), f)) {
+        char *key, *value;
+
+        if (!parse_state_line(buffer, &key, &value))
+            continue;
+
+        if (!strcmp(key, "version"))
+            version = (unsigned int)strtoul(value, NULL, 10);
+        else if (!strcmp(key, "swap_path"))
+            snprintf(fp->swap_path, sizeof(fp->swap_path), "%s", value);
+        else if (!strcmp(key, "dev_uuid"))
+            snprintf(fp->dev_uuid, sizeof(fp->dev_uuid), "%s", value);
+        else if (!strcmp(key, "mem_total"))
+            fp->mem_total = strtoull(value, NULL, 10);
+        else if (!strcmp(key, "inode"))
+            fp->inode = strtoull(value, NULL, 10);
+        else if (!strcmp(key, "dev"))
+            fp->dev = strtoull(value, NULL, 10);
+        else if (!strcmp(key, "size"))
+            fp->size = strtoull(value, NULL, 10);
+        else if (!strcmp(key, "extents_hash"))
+            fp->extents_hash = strtoull(value, NULL, 16);
+        else if (!strcmp(key, "cmdline_hash"))
+            fp->cmdline_hash = strtoull(value, NULL, 16);
+        else if (!strcmp(key, "artifacts_hash"))
+            fp->artifacts_hash = strtoull(value, NULL, 16);
+        else if (!strcmp(key, "options_hash"))
+            fp->options_hash = strtoull(value, NULL, 16);
+        else if (!strcmp(key, "resume_dev"))
+            fp->resume_dev = strtoull(value, NULL, 10);
+        else if (!strcmp(key, "resume_offset"))
+            fp->resume_offset = strtoull(value, NULL, 10);
+        else if (!strcmp(key, "image_size"))
+            fp->image_size = strtoull(value, NULL, 10);
+        else if (!strcmp(key, "compressor"))
+            snprintf(fp->compressor, sizeof(fp->compressor), "%s", value);
+        else if (!strcmp(key, "compression_threads"))
+            fp->compression_threads = strtoull(value, NULL, 10);
+        else if (!strcmp(key, "cpus"))
+            fp->cpus = strtoull(value, NULL, 10);
+        else if (!strcmp(key, "write_bps"))
+            fp->write_bps = strtoull(value, NULL, 10);
+        else if (!strcmp(key, "read_bps"))
+            fp->read_bps = strtoull(value, NULL, 10);
+    }
+
+    fclose(f);
+
+    return version == FINGERPRINT_VERSION && fp->swap_path[0] && fp->dev_uuid[0];
+}
+
+static void save_configuration_fingerprint(struct swap_file *swap)
+{
+    struct configuration_fingerprint fp;
+    char *contents;
+
+    if (!compute_configuration_fingerprint(swap->path, &fp)) {
+        log_info("Could not compute configuration fingerprint; next run will do a full check");
+        unlink(fingerprint_path);
+        return;
+    }
+
+    char *dev_uuid = get_disk_uuid_for_file_path(swap->path);
+    if (!dev_uuid) {
+        unlink(fingerprint_path);
+        return;
+    }
+    snprintf(fp.dev_uuid, sizeof(fp.dev_uuid), "%s", dev_uuid);
+    free(dev_uuid);
+
+    struct resume_swap_area swap_area = get_swap_area(swap);
+    fp.resume_dev = swap_area.dev;
+    fp.resume_offset = swap_area.offset;
+    fp.image_size = budget_image_size;
+    snprintf(fp.compressor, sizeof(fp.compressor), "%s", hibernation_compressor);
+    fp.compression_threads = hibernation_compression_threads;
+    fp.cpus = (uint64_t)compressor_selection_cpus;
+    fp.write_bps = compressor_selection_write_bps;
+    fp.read_bps = compressor_selection_read_bps;
+
+    if (asprintf(&contents,
+                 "version=%d\nswap_path=%s\ndev_uuid=%s\nmem_total=%" PRIu64 "\ninode=%" PRIu64 "\ndev=%" PRIu64 "\nsize=%" PRIu64
+                 "\nextents_hash=%016" PRIx64 "\ncmdline_hash=%016" PRIx64 "\nartifacts_hash=%016" PRIx64 "\noptions_hash=%016" PRIx64 "\nresume_dev=%" PRIu64
+                 "\nresume_offset=%" PRIu64 "\nimage_size=%" PRIu64 "\ncompressor=%s\ncompression_threads=%" PRIu64 "\ncpus=%" PRIu64 "\nwrite_bps=%" PRIu64
+                 "\nread_bps=%" PRIu64 "\n",
+                 FINGERPRINT_VERSION, fp.swap_path, fp.dev_uuid, fp.mem_total, fp.inode, fp.dev, fp.size, fp.extents_hash, fp.cmdline_hash,
+                 fp.artifacts_hash, fp.options_hash, fp.resume_dev, fp.resume_offset, fp.image_size, fp.compressor, fp.compression_threads, fp.cpus,
+                 fp.write_bps, fp.read_bps) < 0)
+        log_fatal("Could not allocate memory for configuration fingerprint");
+
+    if (!ensure_state_dir() || !write_file_atomically(fingerprint_path, contents, 0600))
+        log_info("Could not save configuration fingerprint; next run will do a full check");
+
+    free(contents);
+}
+
+static bool try_rearm_from_fingerprint(struct configuration_fingerprint *current)
+{
+    struct configuration_fingerprint saved;
+    const char *changed = NULL;
+
+    if (!load_configuration_fingerprint(&saved))
+        return false;
+
+    if (!compute_configuration_fingerprint(saved.swap_path, current))
+        changed = "hibernation file";
+    else if (current->mem_total != saved.mem_total)
+        changed = "memory size";
+    else if (current->inode != saved.inode || current->dev != saved.dev || current->size != saved.size || current->extents_hash != saved.extents_hash)
+        changed = "hibernation file";
+    else if (current->cmdline_hash != saved.cmdline_hash)
+        changed = "kernel command line";
+    else if (current->artifacts_hash != saved.artifacts_hash)
+        changed = "system configuration files";
+    else if (current->options_hash != saved.options_hash)
+        changed = "sizing options";
+
+    if (!changed) {
+        char dev_path[PATH_MAX];
+        struct stat st;
+
+        snprintf(dev_path, sizeof(dev_path), "/dev/disk/by-uuid/%s", saved.dev_uuid);
+        if (stat(dev_path, &st) < 0 || st.st_rdev != saved.resume_dev)
+            changed = "device";
+    }
+
+    if (changed) {
+        log_info("%s changed since the last successful run; doing a full check", changed);
+        return false;
+    }
+
+    log_set_swap_file(saved.swap_path);
+
+    if (swapon(saved.swap_path, 0) < 0 && errno != EBUSY) {
+        log_info("Could not enable swap file %s: %s; doing a full check", saved.swap_path, strerror(errno));
+        return false;
+    }
+
+    struct resume_swap_area swap_area = {
+        .offset = saved.resume_offset,
+        .dev = (dev_t)saved.resume_dev,
+    };
+    if (!set_resume_swap_area(swap_area))
+        return false;
+
+    /* The kernel forgets image_size on reboot. */
+    if (saved.image_size && hibernate_time_budget_secs) {
+        if (!write_power_parameter("image_size", saved.image_size))
+            return false;
+        log_info("Limited the hibernation image to %" PRIu64 " MB to stay within the time budget", saved.image_size / MEGA_BYTES);
+    }
+
+    log_info("Nothing changed since the last successful run; swap file %s is ready for hibernation", saved.swap_path);
+
+    return true;
+}
+
+static const char *readlink0(const char *path, char buf[static PATH_MAX])
+{
+    ssize_t len = readlink(path, buf, PATH_MAX - 1);
+
+    if (len < 0)
+        return NULL;
+
+    buf[len] = '\0';
+    return buf;
+}
+
+static bool is_cold_boot(void)
+{
+    char current[1024], hibernated[1024];
+    char lock_file_path_buf[PATH_MAX];
+    const char *lock_file_path;
+    bool cold_boot = false;
+
+    lock_file_path = readlink0(legacy_hibernate_lock_file_name, lock_file_path_buf);
+    if (lock_file_path) {
+        unlink(legacy_hibernate_lock_file_name);
+
+        if (access(lock_file_path, F_OK) < 0)
+            cold_boot = true;
+        else
+            unlink(lock_file_path);
+        rmdir("/tmp/hibernation-setup-tool");
+    }
+
+    if (!read_first_line_from_file(hibernated_boot_id_path, hibernated))
+        return cold_boot;
+
+    if (!read_first_line_from_file("/proc/sys/kernel/random/boot_id", current)) {
+        log_info("Could not read boot ID: %s", strerror(errno));
+        return cold_boot;
+    }
+
+    if (strcmp(current, hibernated) != 0) {
+        cold_boot = true;
+        unlink(hibernated_boot_id_path);
+    }
+
+    return cold_boot;
+}
+
+static void notify_vm_host(enum host_vm_notification notification)
+{
+    static const char *types[] = {
+        [HOST_VM_NOTIFY_COLD_BOOT] = "cold-boot",
+        [HOST_VM_NOTIFY_HIBERNATING] = "hibernating",
+        [HOST_VM_NOTIFY_RESUMED_FROM_HIBERNATION] = "resumed-from-hibernation",
+        [HOST_VM_NOTIFY_PRE_HIBERNATION_FAILED] = "pre-hibernation-failed",
+    };
+
+    log_notice("Changed hibernation state to: %s\n", types[notification]);
+}
+
+/* Written to the kernel log by the pre-hibernation hook, so the post-resume
+ * hook knows where the messages about the current cycle start. */
+static const char kmsg_cycle_marker[] = "hibernation-setup-tool: hibernation cycle starting";
+
+/* Only what the kernel logs before taking the snapshot is recorded: the
+ * kernel log after resuming is the one that was saved in the image, so the
+ * messages about writing it out (and, from the boot kernel, reading it back)
+ * never make it there. */
+struct hibernation_sample {
+    uint64_t timestamp;
+    uint64_t image_pages;
+    uint64_t freeze_user_usec;
+    uint64_t freeze_kernel_usec;
+};
+
+#define HIBERNATION_HISTORY_MAGIC 0x68737468u
+#define HIBERNATION_HISTORY_VERSION 1
+#define HIBERNATION_HISTORY_SIZE 256
+
+/* Fixed-size ring buffer, mmap()ed from hibernation_history_path. */
+struct hibernation_history {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t capacity;
+    uint32_t count;
+    uint32_t next;
+    uint32_t reserved;
+    struct hibernation_sample samples[HIBERNATION_HISTORY_SIZE];
+};
+
+static uint64_t parse_kmsg_seconds(const char *str)
+{
+    unsigned int secs, frac;
+    int frac_digits_start, frac_digits_end;
+
+    if (sscanf(str, "%u.%n%u%n", &secs, &frac_digits_start, &frac, &frac_digits_end) != 2)
+        return 0;
+
+    /* The kernel prints either hundredths or thousandths of a second. */
+    uint64_t usec = (uint64_t)secs * 1000000;
+    switch (frac_digits_end - frac_digits_start) {
+    case 2:
+        return usec + frac * 10000ull;
+    case 3:
+        return usec + frac * 1000ull;
+    default:
+        return usec;
+    }
+}
+
+static void parse_kmsg_line(const char *msg, struct hibernation_sample *sample)
+{
+    const char *p;
+    unsigned int value;
+
+    if ((p = strstr(msg, "Need to copy ")) && sscanf(p, "Need to copy %u pages", &value) == 1) {
+        sample->image_pages = value;
+    } else if (strstr(msg, "Freezing user space processes") && (p = strstr(msg, "(elapsed "))) {
+        sample->freeze_user_usec = parse_kmsg_seconds(p + sizeof("(elapsed ") - 1);
+    } else if (strstr(msg, "Freezing remaining freezable tasks") && (p = strstr(msg, "(elapsed "))) {
+        sample->freeze_kernel_usec = parse_kmsg_seconds(p + sizeof("(elapsed ") - 1);
+    }
+}
+
+static bool parse_kmsg_for_last_cycle(struct hibernation_sample *sample)
+{
+    char record[8192];
+    bool found = false;
+    int fd;
+
+    fd = open("/dev/kmsg", O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        log_info("Could not open /dev/kmsg: %s", strerror(errno));
+        return false;
+    }
+
+    memset(sample, 0, sizeof(*sample));
+
+    for (;;) {
+        ssize_t r = read(fd, record, sizeof(record) - 1);
+
+        if (r < 0) {
+            /* EPIPE means some records were overwritten while reading. */
+            if (errno == EPIPE || errno == EINTR)
+                continue;
+            break;
+        }
+
+        record[r] = '\0';
+
+        /* Records look like "priority,sequence,timestamp,flags;message",
+         * followed by continuation lines starting with a space. */
+        char *msg = strchr(record, ';');
+        if (!msg)
+            continue;
+        msg++;
+
+        char *lf = strchr(msg, '\n');
+        if (lf)
+            *lf = '\0';
+
+        /* Kernels since 5.5 log their own marker right after ours. */
+        if (strstr(msg, kmsg_cycle_marker) || strstr(msg, "PM: hibernation: hibernation entry")) {
+            memset(sample, 0, sizeof(*sample));
+            found = true;
+            continue;
+        }
+
+        if (found)
+            parse_kmsg_line(msg, sample);
+    }
+
+    close(fd);
+
+    if (found)
+        sample->timestamp = (uint64_t)time(NULL);
+
+    return found;
+}
+
+static struct hibernation_history *map_hibernation_history(void)
+{
+    struct hibernation_history *history;
+    int fd;
+
+    if (!ensure_state_dir())
+        return NULL;
+
+    fd = open(hibernation_history_path, O_RDWR | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0600);
+    if (fd < 0) {
+        log_info("Could not open %s: %s", hibernation_history_path, strerror(errno));
+        return NULL;
+    }
+
+    if (ftruncate(fd, sizeof(*history)) < 0) {
+        log_info("Could not resize %s: %s", hibernation_history_path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    history = mmap(NULL, sizeof(*history), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (history == MAP_FAILED) {
+        log_info("Could not map %s: %s", hibernation_history_path, strerror(errno));
+        return NULL;
+    }
+
+    if (history->magic != HIBERNATION_HISTORY_MAGIC || history->version != HIBERNATION_HISTORY_VERSION ||
+        history->capacity != HIBERNATION_HISTORY_SIZE || history->count > HIBERNATION_HISTORY_SIZE || history->next >= HIBERNATION_HISTORY_SIZE) {
+        memset(history, 0, sizeof(*history));
+        history->magic = HIBERNATION_HISTORY_MAGIC;
+        history->version = HIBERNATION_HISTORY_VERSION;
+        history->capacity = HIBERNATION_HISTORY_SIZE;
+    }
+
+    return history;
+}
+
+static void unmap_hibernation_history(struct hibernation_history *history) { munmap(history, sizeof(*history)); }
+
+static void append_hibernation_sample(struct hibernation_history *history, const struct hibernation_sample *sample)
+{
+    history->samples[history->next] = *sample;
+    history->next = (history->next + 1) % history->capacity;
+    if (history->count < history->capacity)
+        history->count++;
+}
+
+static int compare_uint64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Nearest-rank percentile of a sorted array. */
+static uint64_t percentile(const uint64_t *sorted, size_t n, unsigned int pct)
+{
+    size_t rank = (n * pct + 99) / 100;
+
+    return sorted[rank ? rank - 1 : 0];
+}
+
+enum hibernation_metric {
+    METRIC_IMAGE_MB,
+    METRIC_FREEZE_MSEC,
+};
+
+static bool hibernation_sample_metric(const struct hibernation_sample *sample, enum hibernation_metric metric, uint64_t *value)
+{
+    switch (metric) {
+    case METRIC_IMAGE_MB:
+        *value = sample->image_pages * (uint64_t)sysconf(_SC_PAGE_SIZE) / MEGA_BYTES;
+        return sample->image_pages != 0;
+    case METRIC_FREEZE_MSEC:
+        *value = (sample->freeze_user_usec + sample->freeze_kernel_usec) / 1000;
+        return sample->freeze_user_usec != 0;
+    }
+
+    return false;
+}
+
+static void log_hibernation_history_summary(const struct hibernation_history *history)
+{
+    static const struct {
+        enum hibernation_metric metric;
+        const char *name;
+        const char *unit;
+    } metrics[] = {
+        {METRIC_IMAGE_MB, "image size", "MB"},
+        {METRIC_FREEZE_MSEC, "freeze time", "ms"},
+    };
+    uint64_t values[HIBERNATION_HISTORY_SIZE];
+
+    for (size_t m = 0; m < sizeof(metrics) / sizeof(metrics[0]); m++) {
+        size_t n = 0;
+
+        for (uint32_t i = 0; i < history->count; i++) {
+            if (hibernation_sample_metric(&history->samples[i], metrics[m].metric, &values[n]))
+                n++;
+        }
+        if (!n)
+            continue;
+
+        qsort(values, n, sizeof(values[0]), compare_uint64);
+        log_info("Over the last %zu hibernations, %s was p50 %" PRIu64 " %s, p95 %" PRIu64 " %s, p99 %" PRIu64 " %s", n, metrics[m].name,
+                 percentile(values, n, 50), metrics[m].unit, percentile(values, n, 95), metrics[m].unit, percentile(values, n, 99), metrics[m].unit);
+    }
+}
+
+struct image_size_tuning {
+    uint64_t target_secs;
+    uint64_t reserved_size;
+    /* Measured when setting up. */
+    uint64_t write_bps;
+    uint64_t ratio_permille;
+    /* Limit imposed by the time budget; 0 if there's none. */
+    uint64_t max_image_size;
+};
+
+static bool load_image_size_tuning(struct image_size_tuning *tuning)
+{
+    char buffer[256];
+    FILE *f;
+
+    f = fopen(image_size_tuning_path, "re");
+    if (!f)
+        return false;
+
+    memset(tuning, 0, sizeof(*tuning));
+    while (fgets(buffer, sizeof(buffer), f)) {
+        char *key, *value;
+
+        if (!parse_state_line(buffer, &key, &value))
+            continue;
+
+        if (!strcmp(key, "target_secs"))
+            tuning->target_secs = strtoull(value, NULL, 10);
+        else if (!strcmp(key, "reserved_size"))
+            tuning->reserved_size = strtoull(value, NULL, 10);
+        else if (!strcmp(key, "write_bps"))
+            tuning->write_bps = strtoull(value, NULL, 10);
+        else if (!strcmp(key, "ratio_permille"))
+            tuning->ratio_permille = strtoull(value, NULL, 10);
+        else if (!strcmp(key, "max_image_size"))
+            tuning->max_image_size = strtoull(value, NULL, 10);
+    }
+
+    fclose(f);
+    return true;
+}
+
+static void save_image_size_tuning(const struct image_size_tuning *tuning)
+{
+    char *contents;
+
+    if (asprintf(&contents,
+                 "target_secs=%" PRIu64 "\nreserved_size=%" PRIu64 "\nwrite_bps=%" PRIu64 "\nratio_permille=%" PRIu64 "\nmax_image_size=%" PRIu64 "\n",
+                 tuning->target_secs, tuning->reserved_size, tuning->write_bps, tuning->ratio_permille, tuning->max_image_size) < 0)
+        log_fatal("Could not allocate memory for image size tuning");
+
+    if (!ensure_state_dir() || !write_file_atomically(image_size_tuning_path, contents, 0600))
+        log_info("Could not save image size tuning; the hibernation hook won't adjust image_size");
+
+    free(contents);
+}
+
+static bool record_hibernation_cycle(struct hibernation_sample *out)
+{
+    struct hibernation_sample sample;
+    struct hibernation_history *history;
+
+    if (!parse_kmsg_for_last_cycle(&sample)) {
+        log_info("Could not find the start of this hibernation cycle in the kernel log");
+        return false;
+    }
+
+    *out = sample;
+
+    log_info("Hibernation image had %" PRIu64 " pages; freezing took %" PRIu64 " us (user space) and %" PRIu64 " us (kernel threads)",
+             sample.image_pages, sample.freeze_user_usec, sample.freeze_kernel_usec);
+
+    history = map_hibernation_history();
+    if (!history)
+        return true;
+
+    append_hibernation_sample(history, &sample);
+    log_hibernation_history_summary(history);
+    unmap_hibernation_history(history);
+
+    return true;
+}
+
+/* How well memory compresses is estimated by sampling anonymous pages of the
+ * processes using the most memory, as they make up most of a hibernation
+ * image.  Sampling stops after this much CPU time, or this many pages. */
+#define COMPRESSIBILITY_MAX_PROCESSES 16
+#define COMPRESSIBILITY_MAX_SAMPLES 8192
+#define COMPRESSIBILITY_MIN_SAMPLES 64
+#define COMPRESSIBILITY_BATCH 32
+#define COMPRESSIBILITY_CPU_BUDGET_NSEC (200 * 1000000LL)
+
+struct anon_region {
+    uintptr_t start;
+    uint64_t first_page; /* Index of this region's first page among all regions of the process */
+};
+
+struct sampled_process {
+    pid_t pid;
+    uint64_t anon_kb;
+    struct anon_region *regions;
+    size_t n_regions;
+    uint64_t n_pages;
+};
+
+struct compressibility_estimate {
+    size_t n_processes;
+    uint64_t n_pages;
+    uint64_t n_zero_pages;
+    uint64_t ratio_permille;
+    uint64_t ci_permille; /* Half-width of the 95% confidence interval */
+    uint64_t compress_bps; /* LZ4 throughput on a single CPU, for pages that aren't zero-filled */
+};
+
+/* Checks 32 bytes at a time; the compiler turns this into SSE, AVX or NEON
+ * code depending on the target. */
+typedef uint64_t zero_check_vector __attribute__((vector_size(32)));
+
+static bool is_zero_page(const void *page, size_t size)
+{
+    const zero_check_vector *v = page;
+    zero_check_vector acc = {0};
+
+    for (size_t i = 0; i < size / sizeof(*v); i++)
+        acc |= v[i];
+
+    return !(acc[0] | acc[1] | acc[2] | acc[3]);
+}
+
+/* Size of the LZ4 block that'd be produced for a buffer of up to 64KB,
+ * using a greedy single-probe hash table like the reference compressor at
+ * its fastest setting.  Nothing is actually written out. */
+#define LZ4_HASH_LOG 12
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MF_LIMIT 12
+
+static size_t lz4_length_bytes(size_t len) { return len < 15 ? 0 : (len - 15) / 255 + 1; }
+
+static size_t lz4_compressed_size(const uint8_t *src, size_t len)
+{
+    uint16_t table[1 << LZ4_HASH_LOG];
+    size_t out = 0, anchor = 0, ip = 0;
+
+    memset(table, 0, sizeof(table));
+
+    if (len > LZ4_MF_LIMIT) {
+        while (ip < len - LZ4_MF_LIMIT) {
+            uint32_t seq, ref_seq;
+
+            memcpy(&seq, src + ip, sizeof(seq));
+            uint32_t hash = (seq * 2654435761u) >> (32 - LZ4_HASH_LOG);
+            size_t ref = table[hash];
+            table[hash] = (uint16_t)ip;
+
+            memcpy(&ref_seq, src + ref, sizeof(ref_seq));
+            if (ref >= ip || ref_seq != seq) {
+                ip++;
+                continue;
+            }
+
+            size_t match_len = LZ4_MIN_MATCH;
+            while (ip + match_len < len - LZ4_LAST_LITERALS && src[ref + match_len] == src[ip + match_len])
+                match_len++;
+
+            /* Token, literals, 16-bit offset, and extra length bytes. */
+            out += 1 + lz4_length_bytes(ip - anchor) + (ip - anchor) + 2 + lz4_length_bytes(match_len - LZ4_MIN_MATCH);
+            ip += match_len;
+            anchor = ip;
+        }
+    }
+
+    return out + 1 + lz4_length_bytes(len - anchor) + (len - anchor);
+}
+
+static uint64_t xorshift64(uint64_t *state)
+{
+    uint64_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static uint64_t isqrt64(uint64_t n)
+{
+    uint64_t x = n, y = (n + 1) / 2;
+
+    while (y < x) {
+        x = y;
+        y = (x + n / x) / 2;
+    }
+    return x;
+}
+
+static int64_t thread_cpu_nsec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static uint64_t process_anon_kb(pid_t pid)
+{
+    char path[64];
+    char buffer[256];
+    uint64_t anon_kb = 0;
+    FILE *status;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    status = fopen(path, "re");
+    if (!status)
+        return 0;
+
+    while (fgets(buffer, sizeof(buffer), status)) {
+        if (sscanf(buffer, "RssAnon: %" SCNu64, &anon_kb) == 1)
+            break;
+    }
+
+    fclose(status);
+    return anon_kb;
+}
+
+/* Private, writable mappings that aren't backed by a file. */
+static bool load_anon_regions(struct sampled_process *process, size_t page_size)
+{
+    char path[64];
+    char buffer[PATH_MAX + 128];
+    FILE *maps;
+
+    snprintf(path, sizeof(path), "/proc/%d/maps", process->pid);
+    maps = fopen(path, "re");
+    if (!maps)
+        return false;
+
+    while (fgets(buffer, sizeof(buffer), maps)) {
+        uintptr_t start, end;
+        char perms[5];
+        int name_offset = 0;
+
+        if (sscanf(buffer, "%" SCNxPTR "-%" SCNxPTR " %4s %*s %*s %*s %n", &start, &end, perms, &name_offset) != 3 || !name_offset)
+            continue;
+        if (perms[0] != 'r' || perms[1] != 'w' || perms[3] != 'p')
+            continue;
+
+        const char *name = buffer + name_offset;
+        if (*name != '\n' && *name != '\0' && strncmp(name, "[heap]", 6) && strncmp(name, "[stack", 6) && strncmp(name, "[anon:", 6))
+            continue;
+
+        struct anon_region *regions = realloc(process->regions, (process->n_regions + 1) * sizeof(*regions));
+        if (!regions)
+            break;
+
+        process->regions = regions;
+        process->regions[process->n_regions++] = (struct anon_region){.start = start, .first_page = process->n_pages};
+        process->n_pages += (end - start) / page_size;
+    }
+
+    fclose(maps);
+    return process->n_pages != 0;
+}
+
+static size_t find_largest_processes(struct sampled_process processes[static COMPRESSIBILITY_MAX_PROCESSES])
+{
+    struct dirent *ent;
+    size_t n = 0;
+    DIR *proc;
+
+    proc = opendir("/proc");
+    if (!proc)
+        return 0;
+
+    while ((ent = readdir(proc))) {
+        if (!isdigit(ent->d_name[0]))
+            continue;
+
+        pid_t pid = (pid_t)strtol(ent->d_name, NULL, 10);
+        if (pid == getpid())
+            continue;
+
+        /* Kernel threads have no RssAnon. */
+        uint64_t anon_kb = process_anon_kb(pid);
+        if (!anon_kb)
+            continue;
+
+        /* Keep the array sorted by decreasing size. */
+        size_t pos = n;
+        while (pos > 0 && processes[pos - 1].anon_kb < anon_kb)
+            pos--;
+        if (pos >= COMPRESSIBILITY_MAX_PROCESSES)
+            continue;
+        if (n < COMPRESSIBILITY_MAX_PROCESSES)
+            n++;
+        memmove(&processes[pos + 1], &processes[pos], (n - pos - 1) * sizeof(*processes));
+        processes[pos] = (struct sampled_process){.pid = pid, .anon_kb = anon_kb};
+    }
+
+    closedir(proc);
+    return n;
+}
+
+static uintptr_t pick_random_page(const struct sampled_process *process, uint64_t *rng, size_t page_size)
+{
+    uint64_t page = xorshift64(rng) % process->n_pages;
+    size_t lo = 0, hi = process->n_regions;
+
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+
+        if (process->regions[mid].first_page <= page)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    return process->regions[lo].start + (uintptr_t)(page - process->regions[lo].first_page) * page_size;
+}
+
+/* Pages that were never touched, or that are swapped out, aren't part of
+ * the image; bit 63 of the page map entry says whether a page is in RAM. */
+static bool is_page_present(int pagemap_fd, uintptr_t address, size_t page_size)
+{
+    uint64_t entry;
+
+    if (pread(pagemap_fd, &entry, sizeof(entry), (off_t)(address / page_size * sizeof(entry))) != sizeof(entry))
+        return false;
+
+    return entry & (1ull << 63);
+}
+
+static bool estimate_memory_compressibility(struct compressibility_estimate *estimate)
+{
+    struct sampled_process processes[COMPRESSIBILITY_MAX_PROCESSES];
+    size_t page_size = (size_t)sysconf(_SC_PAGE_SIZE);
+    uint64_t sum = 0, total_anon_kb = 0;
+    uint64_t n_batches = 0, sum_batch_means = 0, sum_batch_mean_squares = 0;
+    uint64_t compressed_bytes = 0;
+    int64_t compress_nsec = 0;
+    uint64_t rng;
+    size_t n;
+
+    memset(estimate, 0, sizeof(*estimate));
+
+    if (getrandom(&rng, sizeof(rng), 0) != sizeof(rng) || !rng)
+        rng = (uint64_t)monotonic_usec() | 1;
+
+    /* Scanning /proc for processes and their mappings counts towards the
+     * CPU budget too. */
+    int64_t deadline = thread_cpu_nsec() + COMPRESSIBILITY_CPU_BUDGET_NSEC;
+
+    n = find_largest_processes(processes);
+    for (size_t i = 0; i < n; i++) {
+        if (load_anon_regions(&processes[i], page_size))
+            total_anon_kb += processes[i].anon_kb;
+        else
+            processes[i].anon_kb = 0;
+    }
 
-                if (strstr(buffer, "# hibernation-setup-tool:start")) {
-                    in_az_hibernate_agent_block = true;
-                    continue;
-                }
+    uint8_t *pages = aligned_alloc(page_size, COMPRESSIBILITY_BATCH * page_size);
+    if (!pages || !total_anon_kb) {
+        free(pages);
+        for (size_t i = 0; i < n; i++)
+            free(processes[i].regions);
+        return false;
+    }
 
-                size_t buflen = strlen(buffer);
-                char *tmp = realloc(old_contents, old_contents_len + buflen + 1);
-                if (!tmp)
-                    log_fatal("Could not allocate memory: %s", strerror(errno));
+    size_t zero_page_size = lz4_compressed_size(memset(pages, 0, page_size), page_size);
+    bool sampled[COMPRESSIBILITY_MAX_PROCESSES] = {false};
 
-                memcpy(tmp + old_contents_len, buffer, buflen + 1);
-                old_contents_len += buflen;
-                old_contents = tmp;
-            }
+    for (unsigned int attempts = 0; estimate->n_pages < COMPRESSIBILITY_MAX_SAMPLES && attempts < 4 * COMPRESSIBILITY_MAX_SAMPLES / COMPRESSIBILITY_BATCH; attempts++) {
+        if (thread_cpu_nsec() > deadline)
+            break;
 
-            fclose(resume_cfg);
-        }
+        /* Larger processes contribute proportionally more pages to the image. */
+        uint64_t pick = xorshift64(&rng) % total_anon_kb;
+        size_t p = 0;
+        while (pick >= processes[p].anon_kb)
+            pick -= processes[p++].anon_kb;
 
-        resume_cfg = fopen(grub_cfg_path, "we");
-        if (!resume_cfg)
-            log_fatal("Could not open %s for writing: %s", grub_cfg_path, strerror(errno));
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/%d/pagemap", processes[p].pid);
+        int pagemap_fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (pagemap_fd < 0)
+            continue;
 
-        if (old_contents) {
-            fwrite(old_contents, old_contents_len, 1, resume_cfg);
-            free(old_contents);
+        struct iovec local[COMPRESSIBILITY_BATCH], remote[COMPRESSIBILITY_BATCH];
+        size_t n_iov = 0;
+        for (size_t i = 0; i < COMPRESSIBILITY_BATCH; i++) {
+            uintptr_t address = pick_random_page(&processes[p], &rng, page_size);
+
+            if (!is_page_present(pagemap_fd, address, page_size))
+                continue;
+
+            local[n_iov] = (struct iovec){.iov_base = pages + n_iov * page_size, .iov_len = page_size};
+            remote[n_iov] = (struct iovec){.iov_base = (void *)address, .iov_len = page_size};
+            n_iov++;
         }
+        close(pagemap_fd);
 
-        fprintf(resume_cfg, "\n# hibernation-setup-tool:start\n");
-        fprintf(resume_cfg, "GRUB_CMDLINE_LINUX_DEFAULT=\"$GRUB_CMDLINE_LINUX_DEFAULT %s\"\n", args);
-        fprintf(resume_cfg, "unset GRUB_FORCE_PARTUUID\n");
-        fprintf(resume_cfg, "# hibernation-setup-tool:end\n");
+        if (!n_iov)
+            continue;
 
-        fclose(resume_cfg);
+        /* Transfers stop at the first page that can't be read (e.g. if it
+         * was unmapped in the meantime). */
+        ssize_t ret = process_vm_readv(processes[p].pid, local, n_iov, remote, n_iov, 0);
+        if (ret <= 0)
+            continue;
 
-        if (has_update_grub2) {
-            log_info("Using update-grub2 to patch GRUB configuration in %s", grub_cfg_path);
-            spawn_and_wait("update-grub2", 0);
-        } else if (has_grub2_mkconfig) {
-            const char *grub_cfg_path = find_grub_cfg_path();
+        size_t n_read = (size_t)ret / page_size;
+        size_t sizes[COMPRESSIBILITY_BATCH];
+        for (size_t i = 0; i < n_read; i++) {
+            sizes[i] = is_zero_page(pages + i * page_size, page_size) ? zero_page_size : 0;
+            if (sizes[i])
+                estimate->n_zero_pages++;
+        }
 
-            if (!grub_cfg_path) {
-                ret_value = false;
-            } else {
-                log_info("Using grub2-mkconfig to patch GRUB configuration in %s", grub_cfg_path);
-                spawn_and_wait("grub2-mkconfig", 2, "-o", grub_cfg_path);
+        /* The whole batch is timed at once: reading the clock for every
+         * page would add its own cost to a few microseconds of work. */
+        int64_t start = thread_cpu_nsec();
+        for (size_t i = 0; i < n_read; i++) {
+            if (!sizes[i]) {
+                sizes[i] = lz4_compressed_size(pages + i * page_size, page_size);
+                compressed_bytes += page_size;
             }
         }
+        compress_nsec += thread_cpu_nsec() - start;
+
+        uint64_t batch_sum = 0;
+        for (size_t i = 0; i < n_read; i++) {
+            batch_sum += sizes[i];
+            estimate->n_pages++;
+        }
+        sum += batch_sum;
+
+        uint64_t batch_mean = batch_sum / n_read;
+        sum_batch_means += batch_mean;
+        sum_batch_mean_squares += batch_mean * batch_mean;
+        n_batches++;
+        sampled[p] = true;
     }
 
-    free(args);
+    for (size_t i = 0; i < n; i++) {
+        estimate->n_processes += sampled[i];
+        free(processes[i].regions);
+    }
+    free(pages);
 
-    return ret_value;
+    if (estimate->n_pages < COMPRESSIBILITY_MIN_SAMPLES || n_batches < 2)
+        return false;
+
+    /* All pages in a batch come from the same process, so they aren't
+     * independent samples: each batch counts as one, by its mean. */
+    uint64_t variance = (sum_batch_mean_squares - sum_batch_means * sum_batch_means / n_batches) / (n_batches - 1);
+    uint64_t std_error_x100 = isqrt64(variance * 10000 / n_batches);
+
+    estimate->ratio_permille = sum * 1000 / (estimate->n_pages * page_size);
+    /* 1.96 standard errors on each side. */
+    estimate->ci_permille = 196 * std_error_x100 * 1000 / (10000 * page_size) + 1;
+    estimate->compress_bps = compress_nsec > 0 ? compressed_bytes * 1000000000 / (uint64_t)compress_nsec : 0;
+
+    return true;
 }
 
-static bool update_swap_offset(const struct swap_file *swap)
+static bool is_image_compression_disabled(void)
 {
-    FILE *resume_offset_fp;
-    bool ret = true;
+    char buffer[1024];
+    char *cmdline = read_first_line_from_file("/proc/cmdline", buffer);
 
-    log_info("Updating swap offset");
+    return cmdline && strstr(cmdline, "hibernate=nocompress");
+}
 
-    int fd = open("/dev/snapshot", O_RDONLY | O_CLOEXEC);
+/* Size of compressed images relative to their uncompressed size, in tenths
+ * of a percent: the upper bound estimated by sampling memory, or without a
+ * sample, no compression at all. */
+static uint64_t measured_compression_ratio_permille(const struct compressibility_estimate *estimate, const char **source)
+{
+    *source = "assumed";
+    if (!estimate)
+        return 1000;
+
+    *source = "estimated from a sample of memory";
+    return estimate->ratio_permille + estimate->ci_permille < 1000 ? estimate->ratio_permille + estimate->ci_permille : 1000;
+}
+
+/* Space the kernel keeps free in the swap area for its own I/O (PAGES_FOR_IO). */
+#define HIBERNATION_IO_RESERVE (4 * MEGA_BYTES)
+
+/* Sizes are rounded up to this, so the result doesn't move by a few MB on
+ * every boot as memory usage shifts. */
+#define IMAGE_SIZING_GRANULARITY (256 * MEGA_BYTES)
+
+struct image_estimate {
+    size_t image_size;
+    size_t saveable;
+    size_t max_image;
+    size_t image;
+};
+
+static void estimate_image_size(size_t phys_mem, struct image_estimate *estimate)
+{
+    /* The kernel frees memory until the image is no larger than image_size
+     * (2/5 of RAM by default), but can't go below what must be saved:
+     * anonymous and shared memory (anonymous pages are swapped out rather
+     * than dropped, so they take up the same swap space either way) and
+     * kernel memory that can't be reclaimed.  As the image is a copy of
+     * memory made in memory, it can't be larger than about half of RAM,
+     * minus twice reserved_size. */
+    size_t reserved_size = pending_reserved_size ? pending_reserved_size : read_power_parameter("reserved_size", MEGA_BYTES);
+
+    estimate->image_size = pending_image_size ? pending_image_size : read_power_parameter("image_size", (phys_mem / 5) * 2);
+    estimate->saveable = meminfo_value("AnonPages") + meminfo_value("Shmem") + meminfo_value("SUnreclaim") + meminfo_value("KernelStack") +
+                         meminfo_value("PageTables");
+    estimate->max_image = phys_mem / 2 > 2 * reserved_size ? phys_mem / 2 - 2 * reserved_size : phys_mem / 2;
+
+    estimate->image = estimate->image_size > estimate->saveable ? estimate->image_size : estimate->saveable;
+    if (estimate->image > estimate->max_image)
+        estimate->image = estimate->max_image;
+}
+
+static size_t swap_needed_size_for_image(size_t phys_mem, uint64_t ratio, const char *ratio_source)
+{
+    struct image_estimate estimate;
+
+    estimate_image_size(phys_mem, &estimate);
+
+    size_t image = estimate.image;
+    size_t needed = (size_t)((uint64_t)image * ratio / 1000);
+    needed += (needed / 100) * swap_sizing_margin_pct + HIBERNATION_IO_RESERVE;
+    needed = (needed + IMAGE_SIZING_GRANULARITY - 1) / IMAGE_SIZING_GRANULARITY * IMAGE_SIZING_GRANULARITY;
+
+    log_info("Hibernation image expected to be up to %zu MB (image_size is %zu MB, %zu MB must be saved, the kernel won't write more than %zu MB)",
+             image / MEGA_BYTES, estimate.image_size / MEGA_BYTES, estimate.saveable / MEGA_BYTES, estimate.max_image / MEGA_BYTES);
+    log_info("Images compress to %" PRIu64 ".%" PRIu64 "%% of their size (%s); with a %u%% margin, the swap area needs %zu MB", ratio / 10, ratio % 10,
+             ratio_source, swap_sizing_margin_pct, needed / MEGA_BYTES);
+
+    size_t table_size = swap_size_from_table(phys_mem);
+    if (table_size)
+        log_info("For comparison, the size table would give a swap area of %zu MB", table_size / MEGA_BYTES);
+    else
+        log_info("For comparison, the size table doesn't cover machines with more than 256GB of RAM");
+
+    return needed;
+}
+
+/* Disks are assumed to be at least this fast; images that can be written
+ * within the budget at this speed don't need the throughput measured. */
+#define HIBERNATE_MIN_ASSUMED_THROUGHPUT (50 * MEGA_BYTES)
+
+/* Amount of data written and read back to measure disk throughput. */
+#define THROUGHPUT_BENCHMARK_SIZE (256 * MEGA_BYTES)
+
+/* Writes and reads back an unnamed file next to the hibernation file with
+ * direct I/O, sequentially, like the kernel does with the image. */
+static bool benchmark_disk_throughput(const char *dir, uint64_t *write_bps, uint64_t *read_bps)
+{
+    uint64_t rng = 0x9e3779b97f4a7c15ull;
+    bool ret = false;
+    char *buffer;
+    int fd;
+
+    fd = open(dir, O_TMPFILE | O_RDWR | O_DIRECT | O_CLOEXEC, 0600);
     if (fd < 0) {
-        log_info("Could not open /dev/snapshot: %s", strerror(errno));
+        log_info("Could not create temporary file in %s to measure disk throughput: %s", dir, strerror(errno));
         return false;
     }
 
-    struct resume_swap_area swap_area = get_swap_area(swap);
-    if (ioctl(fd, SNAPSHOT_SET_SWAP_AREA, &swap_area) < 0) {
-        log_info("Could not set resume_swap_area parameters in /dev/snapshot: %s", strerror(errno));
-        close(fd);
-        return false;
+    buffer = aligned_alloc(4096, zero_out_chunk_size);
+    if (!buffer)
+        goto out;
+
+    /* Random data, so nothing along the way can cheat by compressing it. */
+    for (size_t i = 0; i < zero_out_chunk_size / sizeof(uint64_t); i++)
+        ((uint64_t *)buffer)[i] = xorshift64(&rng);
+
+    int64_t start = monotonic_usec();
+    for (size_t offset = 0; offset < THROUGHPUT_BENCHMARK_SIZE; offset += zero_out_chunk_size) {
+        if (pwrite(fd, buffer, zero_out_chunk_size, (off_t)offset) != (ssize_t)zero_out_chunk_size) {
+            log_info("Could not write to temporary file to measure disk throughput: %s", strerror(errno));
+            goto out;
+        }
+    }
+    if (fdatasync(fd) < 0)
+        goto out;
+    int64_t written = monotonic_usec();
+
+    for (size_t offset = 0; offset < THROUGHPUT_BENCHMARK_SIZE; offset += zero_out_chunk_size) {
+        if (pread(fd, buffer, zero_out_chunk_size, (off_t)offset) != (ssize_t)zero_out_chunk_size) {
+            log_info("Could not read from temporary file to measure disk throughput: %s", strerror(errno));
+            goto out;
+        }
     }
+    int64_t read = monotonic_usec();
+
+    *write_bps = (uint64_t)THROUGHPUT_BENCHMARK_SIZE * 1000000 / (uint64_t)(written - start + 1);
+    *read_bps = (uint64_t)THROUGHPUT_BENCHMARK_SIZE * 1000000 / (uint64_t)(read - written + 1);
+    ret = true;
 
+out:
+    free(buffer);
     close(fd);
+    return ret;
+}
 
-    log_info("Updating /sys/power/resume_offset");
-    resume_offset_fp = fopen("/sys/power/resume_offset", "we");
-    if (!resume_offset_fp)
-            log_fatal("Could not open %s for writing: %s", "/sys/power/resume_offset", strerror(errno));
-    if (fprintf(resume_offset_fp, "%llu\n", (unsigned long long)swap_area.offset) <= 0)
-            log_fatal("Failed to write /sys/power/resume_offset.");
-    if (fclose(resume_offset_fp) != 0)
-            log_fatal("Failed to close /sys/power/resume_offset.");
-    log_info("Wrote %llu to /sys/power/resume_offset successfully.", (unsigned long long)swap_area.offset);
+/* Measured once per run, on the file system where the hibernation file is. */
+static bool benchmark_swap_file_dir_throughput(uint64_t *write_bps, uint64_t *read_bps)
+{
+    static uint64_t measured_write_bps, measured_read_bps;
+    static bool measured = false;
 
-    char *dev_uuid = get_disk_uuid_for_file_path(swap->path);
+    if (!measured) {
+        char dir[PATH_MAX];
 
-    if (!dev_uuid)
-        log_fatal("Could not determine device UUID for swap file %s", swap->path);
+        snprintf(dir, sizeof(dir), "%s", swap_file_name);
+        char *slash = strrchr(dir, '/');
+        if (slash == dir || !slash || access(dir, F_OK) < 0)
+            strcpy(dir, "/");
+        else
+            *slash = '\0';
 
-    log_info("Swap file %s is in device UUID %s", swap->path, dev_uuid);
+        if (!benchmark_disk_throughput(dir, &measured_write_bps, &measured_read_bps))
+            return false;
 
-    if (!is_kernel_cmdline_correct(dev_uuid, swap_area.offset)) {
-        log_info("Kernel command-line parameters need updating.");
+        log_info("Disk writes at %" PRIu64 " MB/s and reads at %" PRIu64 " MB/s", measured_write_bps / MEGA_BYTES, measured_read_bps / MEGA_BYTES);
+        measured = true;
+    }
 
-        bool has_grubby = is_exec_in_path("grubby");
-        bool has_update_grub2 = is_exec_in_path("update-grub2");
-        bool has_grub2_mkconfig = is_exec_in_path("grub2-mkconfig");
-        if (has_grubby || has_update_grub2 || has_grub2_mkconfig) {
-            ret = update_kernel_cmdline_params_for_grub(dev_uuid, swap_area, has_grubby, has_update_grub2, has_grub2_mkconfig);
-        } else {
-            log_info(
-                "Could not determine how system was booted to update kernel parameters for next boot.  System won't be able to resume until you fix this.");
-            ret = false;
-        }
+    *write_bps = measured_write_bps;
+    *read_bps = measured_read_bps;
+    return true;
+}
+
+/* Whether the image fits the budget even uncompressed at the slowest
+ * throughput assumed, in which case memory doesn't need to be sampled to
+ * tell how well it compresses. */
+static bool fits_hibernate_time_budget_uncompressed(size_t phys_mem)
+{
+    struct image_estimate estimate;
+
+    if (!hibernate_time_budget_secs)
+        return true;
+
+    estimate_image_size(phys_mem, &estimate);
+    return estimate.image / HIBERNATE_MIN_ASSUMED_THROUGHPUT < hibernate_time_budget_secs;
+}
+
+/* Works out how far image_size must be lowered to stay within the budget,
+ * without changing it yet: that's left to apply_hibernate_time_budget(),
+ * once IMDS allows hibernation. */
+static void plan_hibernate_time_budget(size_t phys_mem, uint64_t ratio)
+{
+    struct image_estimate estimate;
+    uint64_t write_bps, read_bps;
+
+    if (!hibernate_time_budget_secs)
+        return;
+
+    estimate_image_size(phys_mem, &estimate);
+    if (!ratio)
+        ratio = 1;
+    uint64_t compressed = (uint64_t)estimate.image / 1000 * ratio;
+
+    if (compressed / HIBERNATE_MIN_ASSUMED_THROUGHPUT < hibernate_time_budget_secs)
+        return;
+
+    if (!benchmark_swap_file_dir_throughput(&write_bps, &read_bps)) {
+        log_info("Could not measure disk throughput; not checking the time it takes to hibernate");
+        return;
     }
 
-    free(dev_uuid);
-    return ret;
+    uint64_t slowest_bps = write_bps < read_bps ? write_bps : read_bps;
+    uint64_t secs = compressed / slowest_bps;
+    log_info("A %zu MB hibernation image, %" PRIu64 " MB once compressed, would take about %" PRIu64 " s to write and %" PRIu64 " s to read",
+             estimate.image / MEGA_BYTES, compressed / MEGA_BYTES, compressed / write_bps, compressed / read_bps);
+    if (secs <= hibernate_time_budget_secs)
+        return;
+
+    /* Have the kernel free more memory, so there's less of it to save. */
+    uint64_t image_size = (uint64_t)hibernate_time_budget_secs * slowest_bps / ratio * 1000;
+    if (image_size < estimate.saveable)
+        log_fatal("Hibernating would take about %" PRIu64 " s, over the budget of %u s, and at least %zu MB of memory must be saved", secs,
+                  hibernate_time_budget_secs, estimate.saveable / MEGA_BYTES);
+
+    budget_image_size = image_size;
+    pending_image_size = image_size;
+    log_info("Hibernating would take about %" PRIu64 " s, over the budget of %u s; the image will be limited to %" PRIu64 " MB", secs,
+             hibernate_time_budget_secs, image_size / MEGA_BYTES);
 }
 
-static void ensure_swap_is_enabled(const struct swap_file *swap, bool created)
+static void apply_hibernate_time_budget(void)
 {
-    FILE *fstab;
-    char *old_contents = NULL;
-    size_t old_contents_len = 0;
-    char buffer[1024];
+    if (!budget_image_size)
+        return;
 
-    log_info("Ensuring swap file %s is enabled", swap->path);
+    if (!write_power_parameter("image_size", budget_image_size))
+        log_fatal("Could not lower image_size to %zu MB to stay within the hibernation time budget of %u s", budget_image_size / MEGA_BYTES,
+                  hibernate_time_budget_secs);
 
-    if (chmod(swap->path, 0600) < 0)
-        log_fatal("Couldn't set correct permissions on %s: %s", swap->path, strerror(errno));
+    log_info("Limited the hibernation image to %zu MB to stay within the budget of %u s", budget_image_size / MEGA_BYTES, hibernate_time_budget_secs);
+}
 
-    if (swapon(swap->path, 0) < 0) {
-        if (errno == EINVAL && !created)
-            log_fatal("%s exists but kernel isn't accepting it as a swap file. Try removing it and re-running the agent.", swap->path);
+/* Image bytes (before compression) written per second, and the image_size
+ * that can be written within the target time at that rate.  False if
+ * there's no target, or the rate isn't known. */
+static bool tuned_image_size(const struct image_size_tuning *tuning, uint64_t *rate, uint64_t *image_size)
+{
+    if (!tuning->target_secs || !tuning->write_bps || !tuning->ratio_permille)
+        return false;
 
-        if (errno != EBUSY)
-            log_fatal("Could not enable swap file: %s", strerror(errno));
+    *rate = tuning->write_bps * 1000 / tuning->ratio_permille;
+
+    size_t phys_mem = physical_memory();
+    size_t reserved_size = tuning->reserved_size ? tuning->reserved_size : read_power_parameter("reserved_size", MEGA_BYTES);
+    uint64_t max_image = phys_mem / 2 > 2 * reserved_size ? phys_mem / 2 - 2 * reserved_size : phys_mem / 2;
+
+    *image_size = tuning->target_secs * *rate;
+    if (*image_size > max_image)
+        *image_size = max_image;
+    if (tuning->max_image_size && *image_size > tuning->max_image_size)
+        *image_size = tuning->max_image_size;
+
+    return true;
+}
+
+/* Sets reserved_size, and image_size to what can be written within the
+ * target time.  Done when setting up, and again before every hibernation,
+ * in case something else changed them since. */
+static void apply_image_size_tuning(void)
+{
+    struct image_size_tuning tuning;
+    uint64_t rate, image_size;
+
+    if (!load_image_size_tuning(&tuning))
+        return;
+
+    if (tuning.reserved_size && write_power_parameter("reserved_size", tuning.reserved_size))
+        log_info("Set reserved_size to %" PRIu64 " MB", tuning.reserved_size / MEGA_BYTES);
+
+    if (!tuning.target_secs)
+        return;
+
+    if (!tuned_image_size(&tuning, &rate, &image_size)) {
+        log_info("Don't know how fast the hibernation image can be written; leaving image_size alone");
+        return;
     }
 
-    log_info("Updating /etc/fstab");
+    if (write_power_parameter("image_size", image_size))
+        log_info("Set image_size to %" PRIu64 " MB to hibernate in about %" PRIu64 " s at %" PRIu64 " MB/s", image_size / MEGA_BYTES,
+                 tuning.target_secs, rate / MEGA_BYTES);
+}
 
-    fstab = fopen("/etc/fstab", "re");
-    if (!fstab)
-        log_fatal("Could not open fstab: %s", strerror(errno));
+static bool image_size_tuning_options_changed(void)
+{
+    struct image_size_tuning tuning;
 
-    while (fgets(buffer, sizeof(buffer), fstab)) {
-        if (strstr(buffer, swap->path))
-            continue;
+    if (!load_image_size_tuning(&tuning))
+        memset(&tuning, 0, sizeof(tuning));
 
-        size_t buflen = strlen(buffer);
-        char *tmp = realloc(old_contents, old_contents_len + buflen + 1);
+    if (tuning.target_secs == target_hibernate_time_secs && tuning.reserved_size == reserved_size_override)
+        return false;
+
+    log_info("Image size tuning options changed since the last successful run; doing a full check");
+    return true;
+}
+
+/* Measures what the tuning needs, without changing anything yet, and notes
+ * the values it'll set for estimating the hibernation image. */
+static void plan_image_size_tuning(struct image_size_tuning *tuning, uint64_t ratio)
+{
+    uint64_t rate, image_size, read_bps;
+
+    *tuning = (struct image_size_tuning){
+        .target_secs = target_hibernate_time_secs,
+        .reserved_size = reserved_size_override,
+        .max_image_size = budget_image_size,
+    };
+
+    if (target_hibernate_time_secs) {
+        tuning->ratio_permille = ratio;
+        if (!benchmark_swap_file_dir_throughput(&tuning->write_bps, &read_bps))
+            tuning->write_bps = 0;
+    }
+
+    pending_reserved_size = tuning->reserved_size;
+    if (tuned_image_size(tuning, &rate, &image_size))
+        pending_image_size = image_size;
+}
+
+/* Saves the tuning for the pre-hibernation hook, and applies it. */
+static void configure_image_size_tuning(const struct image_size_tuning *tuning)
+{
+    if (!tuning->target_secs && !tuning->reserved_size) {
+        if (unlink(image_size_tuning_path) < 0 && errno != ENOENT)
+            log_info("Could not remove %s: %s", image_size_tuning_path, strerror(errno));
+        return;
+    }
+
+    save_image_size_tuning(tuning);
+    apply_image_size_tuning();
+}
+
+/* There's no LZO implementation here to benchmark, so it's estimated from
+ * the LZ4 measurements with these factors (in percent), taken from the
+ * usual figures for LZO1X-1 and LZ4 at their fastest settings: LZO
+ * compresses slightly better, a bit slower, and decompresses far slower.
+ * Decompression isn't benchmarked either. */
+#define LZO_RATIO_PCT_OF_LZ4 92
+#define LZO_COMPRESS_PCT_OF_LZ4 75
+#define LZ4_DECOMPRESS_PCT_OF_COMPRESS 500
+#define LZO_DECOMPRESS_PCT_OF_LZ4_COMPRESS 200
+
+/* A full run measures everything again, so the models move a little from
+ * run to run.  A different choice changes the kernel command line, so the
+ * one made before is kept unless the new one is faster by this much (in
+ * percent). */
+#define COMPRESSOR_RESELECTION_MARGIN_PCT 10
+
+/* The kernel caps compression threads at this many if it can't be told. */
+#define KERNEL_DEFAULT_COMPRESSION_THREADS 3
+#define MAX_COMPRESSION_THREADS 16
+
+static const char hibernate_compressor_param[] = "/sys/module/hibernate/parameters/compressor";
+
+struct compressor_model {
+    const char *name;
+    double ratio;
+    double compress_bps;
+    double decompress_bps;
+};
+
+/* Compression and I/O overlap, so each direction takes as long as the
+ * slower of the two. */
+static double model_hibernation_secs(const struct compressor_model *model, unsigned int threads, double image, double write_bps, double read_bps)
+{
+    double compressed = image * model->ratio;
+    double write_secs = compressed / write_bps;
+    double read_secs = compressed / read_bps;
+    double compress_secs = image / (model->compress_bps * threads);
+    double decompress_secs = image / (model->decompress_bps * threads);
+
+    return (compress_secs > write_secs ? compress_secs : write_secs) + (decompress_secs > read_secs ? decompress_secs : read_secs);
+}
+
+static bool is_compressor_selection_supported(void) { return !access(hibernate_compressor_param, W_OK); }
+
+/* The choice goes on the kernel command line, so a full run is needed to
+ * make it, and to make it again when the number of CPUs has changed. */
+static bool is_compressor_selection_pending(void)
+{
+    struct configuration_fingerprint saved;
+
+    if (!select_compressor || !is_compressor_selection_supported())
+        return false;
+
+    /* Without a fingerprint, there's a full run anyway. */
+    if (!load_configuration_fingerprint(&saved))
+        return false;
+
+    if (!saved.compressor[0]) {
+        log_info("Hibernation compressor hasn't been selected yet; doing a full check");
+        return true;
+    }
+
+    if (saved.cpus != (uint64_t)sysconf(_SC_NPROCESSORS_ONLN)) {
+        log_info("Number of CPUs changed since the hibernation compressor was selected; doing a full check");
+        return true;
+    }
+
+    return false;
+}
+
+static void select_hibernation_compressor(size_t phys_mem, const struct compressibility_estimate *estimate)
+{
+    struct image_estimate image;
+    uint64_t write_bps, read_bps;
+
+    if (!select_compressor)
+        return;
+
+    if (!is_compressor_selection_supported()) {
+        log_info("Kernel doesn't support choosing the hibernation compressor");
+        return;
+    }
+
+    if (!estimate || !estimate->compress_bps) {
+        log_info("Could not sample enough memory to choose a hibernation compressor");
+        return;
+    }
+
+    if (!benchmark_swap_file_dir_throughput(&write_bps, &read_bps)) {
+        log_info("Could not measure disk throughput to choose a hibernation compressor");
+        return;
+    }
+
+    estimate_image_size(phys_mem, &image);
+
+    double lz4_ratio = (double)estimate->ratio_permille / 1000;
+    double lz4_bps = (double)estimate->compress_bps;
+    const struct compressor_model models[] = {
+        {"lzo", lz4_ratio * LZO_RATIO_PCT_OF_LZ4 / 100, lz4_bps * LZO_COMPRESS_PCT_OF_LZ4 / 100, lz4_bps * LZO_DECOMPRESS_PCT_OF_LZ4_COMPRESS / 100},
+        {"lz4", lz4_ratio, lz4_bps, lz4_bps * LZ4_DECOMPRESS_PCT_OF_COMPRESS / 100},
+    };
+
+    /* One CPU is left for the thread doing the I/O. */
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int max_threads = cpus > 2 ? (unsigned int)(cpus - 1) : 1;
+    if (max_threads > MAX_COMPRESSION_THREADS)
+        max_threads = MAX_COMPRESSION_THREADS;
+
+    /* Without the knob, the kernel picks the number of threads itself. */
+    bool can_set_threads = !access("/sys/power/hibernate_compression_threads", W_OK);
+    unsigned int min_threads = 1;
+    if (!can_set_threads)
+        min_threads = max_threads = max_threads < KERNEL_DEFAULT_COMPRESSION_THREADS ? max_threads : KERNEL_DEFAULT_COMPRESSION_THREADS;
+
+    const struct compressor_model *best = NULL;
+    unsigned int best_threads = 0;
+    double best_secs = 0;
+    for (size_t i = 0; i < sizeof(models) / sizeof(models[0]); i++) {
+        unsigned int model_threads = 0;
+        double model_secs = 0;
+
+        /* More threads only win if they're noticeably faster. */
+        for (unsigned int threads = min_threads; threads <= max_threads; threads++) {
+            double secs = model_hibernation_secs(&models[i], threads, (double)image.image, (double)write_bps, (double)read_bps);
+
+            if (!model_threads || secs < model_secs * 0.99) {
+                model_threads = threads;
+                model_secs = secs;
+            }
+        }
 
-        if (!tmp)
-            log_fatal("Couldn't allocate memory");
+        log_info("With %s and %u thread(s), a %zu MB image would take about %.1f s to write and read back", models[i].name, model_threads,
+                 image.image / MEGA_BYTES, model_secs);
 
-        memcpy(tmp + old_contents_len, buffer, buflen + 1);
-        old_contents_len += buflen;
-        old_contents = tmp;
+        if (!best || model_secs < best_secs) {
+            best = &models[i];
+            best_threads = model_threads;
+            best_secs = model_secs;
+        }
     }
 
-    fclose(fstab);
+    /* The CPU count is the only thing that makes a new choice necessary. */
+    struct configuration_fingerprint saved;
+    if (load_configuration_fingerprint(&saved) && saved.compressor[0] && saved.cpus == (uint64_t)cpus &&
+        (saved.compression_threads != 0) == can_set_threads) {
+        for (size_t i = 0; i < sizeof(models) / sizeof(models[0]); i++) {
+            if (strcmp(models[i].name, saved.compressor) != 0)
+                continue;
 
-    fstab = fopen("/etc/fstab", "we");
-    if (!fstab)
-        log_fatal("Could not open fstab for writing: %s", strerror(errno));
+            unsigned int saved_threads = can_set_threads ? (unsigned int)saved.compression_threads : min_threads;
+            if (saved_threads < min_threads || saved_threads > max_threads)
+                break;
 
-    if (old_contents) {
-        fwrite(old_contents, old_contents_len, 1, fstab);
-        free(old_contents);
+            double saved_secs = model_hibernation_secs(&models[i], saved_threads, (double)image.image, (double)write_bps, (double)read_bps);
+            if (best_secs * 100 > saved_secs * (100 - COMPRESSOR_RESELECTION_MARGIN_PCT)) {
+                if (best != &models[i] || best_threads != saved_threads)
+                    log_info("Keeping %s with %u compression thread(s), selected before: %s with %u isn't at least %d%% faster", models[i].name,
+                             saved_threads, best->name, best_threads, COMPRESSOR_RESELECTION_MARGIN_PCT);
+                best = &models[i];
+                best_threads = saved_threads;
+                best_secs = saved_secs;
+                write_bps = saved.write_bps;
+                read_bps = saved.read_bps;
+            }
+        }
     }
-    fprintf(fstab, "\n%s\tnone\tswap\tswap\t0\t0\n", swap->path);
 
-    fclose(fstab);
+    snprintf(hibernation_compressor, sizeof(hibernation_compressor), "%s", best->name);
+    if (can_set_threads)
+        hibernation_compression_threads = best_threads;
+    compressor_selection_cpus = cpus;
+    compressor_selection_write_bps = write_bps;
+    compressor_selection_read_bps = read_bps;
+
+    log_info("Selected %s with %u compression thread(s); hibernating and resuming should take about %.1f s", best->name, best_threads, best_secs);
+
+    FILE *fp = fopen(hibernate_compressor_param, "we");
+    if (!fp || fprintf(fp, "%s\n", best->name) < 0 || fclose(fp) != 0)
+        log_info("Could not set hibernation compressor: %s", strerror(errno));
+    if (can_set_threads)
+        write_power_parameter("hibernate_compression_threads", best_threads);
 }
 
-static void ensure_udev_rules_are_installed(void)
+static int report_compressibility(void)
 {
-    char systemctl_path_buf[PATH_MAX];
-    const char *udev_rule_path;
-    const char *systemctl_path;
+    struct compressibility_estimate estimate;
+    struct image_estimate image;
 
-    systemctl_path = find_executable_in_path("systemctl", NULL, systemctl_path_buf);
-    if (!systemctl_path) {
-        log_info("systemctl not found or not executable, udev rule won't work");
-        return;
-    }
-    if (!is_exec_in_path("udevadm")) {
-        log_info("udevadm has not been found in $PATH; maybe system doesn't use systemd?");
-        return;
-    }
+    if (!estimate_memory_compressibility(&estimate))
+        log_fatal("Could not sample enough memory to estimate how well it compresses");
 
-    if (!access("/usr/lib/udev/rules.d", F_OK)) {
-        udev_rule_path = "/usr/lib/udev/rules.d/99-vm-hibernation.rules";
-    } else if (!access("/etc/udev/rules.d", F_OK)) {
-        udev_rule_path = "/etc/udev/rules.d/99-vm-hibernation.rules";
-    } else if (!access("/lib/udev/rules.d", F_OK)) {
-        udev_rule_path = "/lib/udev/rules.d/99-vm-hibernation.rules";
-    } else {
-        log_info("Couldn't find where udev stores the rules.  VM may not hibernate.");
-        return;
-    }
+    estimate_image_size(physical_memory(), &image);
 
-    FILE *rule_file = fopen(udev_rule_path, "we");
-    if (!rule_file)
-        log_fatal("Could not open '%s' for writing: %s", udev_rule_path, strerror(errno));
-    fprintf(rule_file,
-            "SUBSYSTEM==\"vmbus\", ACTION==\"change\", "
-            "DRIVER==\"hv_utils\", ENV{EVENT}==\"hibernate\", "
-            "RUN+=\"%s hibernate\"\n",
-            systemctl_path);
-    fclose(rule_file);
+    uint64_t low = estimate.ratio_permille > estimate.ci_permille ? estimate.ratio_permille - estimate.ci_permille : 0;
+    uint64_t high = estimate.ratio_permille + estimate.ci_permille;
 
-    log_info("udev rule to hibernate with systemd set up in %s.  Telling udev about it.", udev_rule_path);
+    log_info("Sampled %" PRIu64 " pages from %zu processes; %" PRIu64 " of them (%" PRIu64 "%%) were zero-filled", estimate.n_pages,
+             estimate.n_processes, estimate.n_zero_pages, estimate.n_zero_pages * 100 / estimate.n_pages);
+    log_info("Memory compresses to %" PRIu64 ".%" PRIu64 "%% of its size with LZ4 (95%% confidence interval: %" PRIu64 ".%" PRIu64 "%% to %" PRIu64
+             ".%" PRIu64 "%%)",
+             estimate.ratio_permille / 10, estimate.ratio_permille % 10, low / 10, low % 10, high / 10, high % 10);
+    log_info("LZ4 compresses %" PRIu64 " MB/s on a single CPU", estimate.compress_bps / MEGA_BYTES);
+    log_info("A %zu MB hibernation image would take %zu MB (%zu MB to %zu MB) once compressed", image.image / MEGA_BYTES,
+             (size_t)(image.image / 1000 * estimate.ratio_permille / MEGA_BYTES), (size_t)(image.image / 1000 * low / MEGA_BYTES),
+             (size_t)(image.image / 1000 * high / MEGA_BYTES));
 
-    /* This isn't strictly necessary, but do it anyway just in case. */
-    spawn_and_wait("udevadm", 2, "control", "--reload-rules");
-    spawn_and_wait("udevadm", 1, "trigger");
+    return 0;
 }
 
-static const char *readlink0(const char *path, char buf[static PATH_MAX])
+static const char *get_prometheus_dir(void)
 {
-    ssize_t len = readlink(path, buf, PATH_MAX - 1);
+    struct stat st;
 
-    if (len < 0)
-        return NULL;
+    if (prometheus_dir)
+        return prometheus_dir[0] ? prometheus_dir : NULL;
 
-    buf[len] = '\0';
-    return buf;
+    if (!stat(default_prometheus_dir, &st) && S_ISDIR(st.st_mode))
+        return default_prometheus_dir;
+
+    return NULL;
 }
 
-static bool is_cold_boot(void)
+static void write_prometheus_file(const char *file_name, const char *contents)
 {
-    /* We detect cold boot by creating a file in a tmpfs filesystem right
-     * before asking system to hibernate.  If this file is not there during
-     * agent startup, then it's a cold boot and resuming failed; if it's
-     * still there, then we successfully resumed.  */
-    char lock_file_path_buf[PATH_MAX];
-    const char *lock_file_path;
+    const char *dir = get_prometheus_dir();
+    char path[PATH_MAX];
 
-    lock_file_path = readlink0(hibernate_lock_file_name, lock_file_path_buf);
-    if (lock_file_path) {
-        unlink(hibernate_lock_file_name);
+    if (!dir)
+        return;
 
-        if (access(lock_file_path, F_OK) < 0)
-            return true;
+    int r = snprintf(path, sizeof(path), "%s/%s", dir, file_name);
+    if (r < 0 || r >= (int)sizeof(path))
+        return;
+
+    /* node_exporter may read the file at any time, so it has to be
+     * replaced atomically. */
+    if (!write_file_atomically(path, contents, 0644))
+        log_info("Could not write metrics to %s", path);
+}
+
+static void load_counters(uint64_t *cold_boots, uint64_t *resumes)
+{
+    char buffer[128];
+    FILE *f;
 
-        unlink(lock_file_path);
+    *cold_boots = *resumes = 0;
+
+    f = fopen(counters_path, "re");
+    if (!f)
+        return;
+
+    while (fgets(buffer, sizeof(buffer), f)) {
+        char *key, *value;
+
+        if (!parse_state_line(buffer, &key, &value))
+            continue;
+
+        if (!strcmp(key, "cold_boots"))
+            *cold_boots = strtoull(value, NULL, 10);
+        else if (!strcmp(key, "resumes"))
+            *resumes = strtoull(value, NULL, 10);
     }
 
-    return false;
+    fclose(f);
 }
 
-static void notify_vm_host(enum host_vm_notification notification)
+static void increment_counter(bool cold_boot)
 {
-    static const char *types[] = {
-        [HOST_VM_NOTIFY_COLD_BOOT] = "cold-boot",
-        [HOST_VM_NOTIFY_HIBERNATING] = "hibernating",
-        [HOST_VM_NOTIFY_RESUMED_FROM_HIBERNATION] = "resumed-from-hibernation",
-        [HOST_VM_NOTIFY_PRE_HIBERNATION_FAILED] = "pre-hibernation-failed",
-    };
+    uint64_t cold_boots, resumes;
+    char contents[128];
+
+    load_counters(&cold_boots, &resumes);
+    if (cold_boot)
+        cold_boots++;
+    else
+        resumes++;
+
+    snprintf(contents, sizeof(contents), "cold_boots=%" PRIu64 "\nresumes=%" PRIu64 "\n", cold_boots, resumes);
+    if (!ensure_state_dir() || !write_file_atomically(counters_path, contents, 0600))
+        log_info("Could not update %s", counters_path);
+}
 
-    log_notice("Changed hibernation state to: %s\n", types[notification]);
+static void write_prometheus_metric_header(FILE *out, const char *name, const char *type, const char *help)
+{
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
 }
 
-static int recursive_rmdir_cb(const char *fpath, const struct stat *st, int typeflag, struct FTW *ftwbuf)
+/* Label values only have escapes for backslashes, double quotes and line
+ * feeds; everything else is written as is. */
+static void prometheus_escape_label(FILE *out, const char *str)
 {
-    (void)st;
-    (void)ftwbuf;
+    for (; *str; str++) {
+        switch (*str) {
+        case '\\':
+            fputs("\\\\", out);
+            break;
+        case '"':
+            fputs("\\\"", out);
+            break;
+        case '\n':
+            fputs("\\n", out);
+            break;
+        default:
+            fputc(*str, out);
+        }
+    }
+}
 
-    switch (typeflag) {
-    case FTW_SLN: /* symbolic link pointing to a non-existing file */
-    case FTW_F:   /* regular file */
-        return unlink(fpath) == 0 ? FTW_CONTINUE : FTW_STOP;
+static void write_setup_metrics(const char *swap_path, uint64_t size, uint64_t n_extents)
+{
+    uint64_t cold_boots, resumes;
+    char *contents = NULL;
+    size_t contents_len;
+    FILE *out;
 
-    case FTW_D: /* directory */
-        return rmdir(fpath) == 0 ? FTW_CONTINUE : FTW_STOP;
+    if (!get_prometheus_dir())
+        return;
 
-    case FTW_DP: 
-        log_info("Removing %s directory. Its subdirectories and subfiles have been visited.", fpath);
-        return rmdir(fpath) == 0 ? FTW_CONTINUE : FTW_STOP;
-    
-    case FTW_SL:
-        /* We refuse to follow symbolic links as it might lead us to some directory outside
-         * the one we're trying to remove.  The only symlinks we care about are those that
-         * point to a path that does not exist, but we delete those before doing anything
-         * anyway. */
-        log_info("%s is a symbolic link. Refusing to follow.", fpath);
-        return FTW_STOP;
+    out = open_memstream(&contents, &contents_len);
+    if (!out)
+        return;
 
-    case FTW_DNR:
-        log_info("Can't read directory %s", fpath);
-        return FTW_STOP;
+    load_counters(&cold_boots, &resumes);
 
-    case FTW_NS:
-        log_info("stat() failed on %s", fpath);
-        return FTW_STOP;
+    write_prometheus_metric_header(out, "hibernation_swap_file_size_bytes", "gauge", "Size of the hibernation file.");
+    fprintf(out, "hibernation_swap_file_size_bytes{path=\"");
+    prometheus_escape_label(out, swap_path);
+    fprintf(out, "\"} %" PRIu64 "\n", size);
 
-    default:
-        log_info("nftw callback called with unknown typeflag %d, stopping", typeflag);
-        return FTW_STOP;
-    }
-}
+    write_prometheus_metric_header(out, "hibernation_swap_file_extents", "gauge", "Number of extents in the hibernation file.");
+    fprintf(out, "hibernation_swap_file_extents %" PRIu64 "\n", n_extents);
 
-static bool recursive_rmdir(const char *path) { return nftw(path, recursive_rmdir_cb, 16, FTW_DEPTH | FTW_PHYS | FTW_ACTIONRETVAL) == 0; }
+    write_prometheus_metric_header(out, "hibernation_cold_boots_total", "counter", "Boots that didn't resume from a hibernation image.");
+    fprintf(out, "hibernation_cold_boots_total %" PRIu64 "\n", cold_boots);
 
-static int handle_pre_systemd_suspend_notification(const char *action)
-{
-    log_needs_pre_hook_prefix = true;
-    if (!strcmp(action, "hibernate")) {
-        log_info("Running pre-hibernate hooks");
+    /* Phase durations come from the trace, which is recorded when metrics are exported. */
+    const struct trace_event *imds = NULL;
+    pthread_mutex_lock(&trace_lock);
+    write_prometheus_metric_header(out, "hibernation_setup_phase_duration_seconds", "gauge", "Duration of each phase of the last setup run.");
+    for (size_t i = 0; i < n_trace_events; i++) {
+        const struct trace_event *event = &trace_events[i];
+        bool seen = false;
 
-        /* Creating this directory with the right permissions is racy as
-         * we're writing to tmp which is world-writable.  So do our best
-         * here to ensure that if this for loop terminates normally, the
-         * directory is empty and readable/writable only by us.  In normal
-         * scenarios (i.e. nobody else tried creating a directory with that
-         * name), this will succeed the first try.  This directory will be
-         * removed when we resume. */
-        for (int try = 0;; try++) {
-            if (try > 10) {
-                notify_vm_host(HOST_VM_NOTIFY_PRE_HIBERNATION_FAILED);
-                log_fatal("Tried too many times to create /tmp/hibernation-setup-tool and failed. Giving up");
-            }
+        if (strcmp(event->category, "phase") != 0 || !event->name)
+            continue;
+        if (!strcmp(event->name, "IMDS"))
+            imds = event;
+
+        /* A phase that ran more than once is a single series, with the
+         * time spent in all of its runs. */
+        for (size_t j = 0; j < i && !seen; j++)
+            seen = !strcmp(trace_events[j].category, "phase") && trace_events[j].name && !strcmp(trace_events[j].name, event->name);
+        if (seen)
+            continue;
 
-            if (!mkdir("/tmp/hibernation-setup-tool", 0700))
-                break;
-            if (errno != EEXIST) {
-                notify_vm_host(HOST_VM_NOTIFY_PRE_HIBERNATION_FAILED);
-                log_fatal("Couldn't create location to store hibernation agent state: %s", strerror(errno));
-            }
+        int64_t dur_usec = 0;
+        for (size_t j = i; j < n_trace_events; j++) {
+            if (!strcmp(trace_events[j].category, "phase") && trace_events[j].name && !strcmp(trace_events[j].name, event->name))
+                dur_usec += trace_events[j].dur_usec;
+        }
+
+        fprintf(out, "hibernation_setup_phase_duration_seconds{phase=\"");
+        prometheus_escape_label(out, event->name);
+        fprintf(out, "\"} %.6f\n", (double)dur_usec / 1e6);
+    }
+    if (imds) {
+        write_prometheus_metric_header(out, "hibernation_imds_latency_seconds", "gauge", "Time taken to learn whether IMDS allows hibernation.");
+        fprintf(out, "hibernation_imds_latency_seconds %.6f\n", (double)imds->dur_usec / 1e6);
+    }
+    pthread_mutex_unlock(&trace_lock);
 
-            struct stat st;
-            if (!stat("/tmp/hibernation-setup-tool", &st)) {
-                if (S_ISDIR(st.st_mode)) {
-                    log_info("/tmp/hibernation-setup-tool exists, removing it");
+    write_prometheus_metric_header(out, "hibernation_setup_last_success_timestamp_seconds", "gauge", "When the last setup run finished.");
+    fprintf(out, "hibernation_setup_last_success_timestamp_seconds %" PRId64 "\n", (int64_t)time(NULL));
 
-                    if (umount2("/tmp/hibernation-setup-tool", UMOUNT_NOFOLLOW | MNT_DETACH) < 0) {
-                        /* See comment related to the umount2() call in handle_post_systemd_suspend_notification(). */
-                        if (errno != EINVAL)
-                            log_fatal("Error while unmounting /tmp/hibernation-setup-tool: %s", strerror(errno));
-                    }
+    if (fclose(out) == 0)
+        write_prometheus_file("hibernation-setup-tool.prom", contents);
 
-                    if (recursive_rmdir("/tmp/hibernation-setup-tool"))
-                        continue;
+    free(contents);
+}
 
-                    notify_vm_host(HOST_VM_NOTIFY_PRE_HIBERNATION_FAILED);
-                    log_fatal("Couldn't remove /tmp/hibernation-setup-tool directory before proceeding");
-                }
+static void write_hook_metrics(const struct hibernation_sample *sample)
+{
+    uint64_t cold_boots, resumes;
+    char *contents = NULL;
+    size_t contents_len;
+    uint64_t value;
+    FILE *out;
 
-                log_info("/tmp/hibernation-setup-tool exists and isn't a directory! Removing it and trying again (try %d)", try);
+    if (!get_prometheus_dir())
+        return;
 
-                if (!unlink("/tmp/hibernation-setup-tool"))
-                    continue;
+    out = open_memstream(&contents, &contents_len);
+    if (!out)
+        return;
 
-                notify_vm_host(HOST_VM_NOTIFY_PRE_HIBERNATION_FAILED);
-                log_fatal("Couldn't remove the file: %s, giving up", strerror(errno));
-            }
+    load_counters(&cold_boots, &resumes);
 
-            log_info("/tmp/hibernation-setup-tool couldn't be found but mkdir() told us it exists, trying again (try %d)", try);
-            continue;
+    write_prometheus_metric_header(out, "hibernation_resumes_total", "counter", "Successful resumes from hibernation.");
+    fprintf(out, "hibernation_resumes_total %" PRIu64 "\n", resumes);
+
+    write_prometheus_metric_header(out, "hibernation_last_resume_timestamp_seconds", "gauge", "When the system last resumed from hibernation.");
+    fprintf(out, "hibernation_last_resume_timestamp_seconds %" PRId64 "\n", (int64_t)time(NULL));
+
+    if (sample) {
+        if (hibernation_sample_metric(sample, METRIC_IMAGE_MB, &value)) {
+            write_prometheus_metric_header(out, "hibernation_last_image_bytes", "gauge", "Size of the last hibernation image.");
+            fprintf(out, "hibernation_last_image_bytes %" PRIu64 "\n", sample->image_pages * (uint64_t)sysconf(_SC_PAGE_SIZE));
+        }
+        if (hibernation_sample_metric(sample, METRIC_FREEZE_MSEC, &value)) {
+            write_prometheus_metric_header(out, "hibernation_last_freeze_seconds", "gauge", "Time taken to freeze tasks before the last hibernation.");
+            fprintf(out, "hibernation_last_freeze_seconds %.6f\n", (double)(sample->freeze_user_usec + sample->freeze_kernel_usec) / 1e6);
         }
+    }
 
-        if (!is_file_on_fs("/tmp/hibernation-setup-tool", TMPFS_MAGIC)) {
-            log_info("/tmp isn't a tmpfs filesystem; trying to mount /tmp/hibernation-setup-tool as such");
+    if (fclose(out) == 0)
+        write_prometheus_file("hibernation-setup-tool-hooks.prom", contents);
 
-            if (mount("tmpfs", "/tmp/hibernation-setup-tool", "tmpfs", 0, NULL) < 0) {
-                notify_vm_host(HOST_VM_NOTIFY_PRE_HIBERNATION_FAILED);
-                log_fatal("Couldn't mount temporary filesystem: %s. We need this to detect cold boots!", strerror(errno));
-            }
+    free(contents);
+}
+
+static int handle_pre_systemd_suspend_notification(const char *action)
+{
+    log_needs_pre_hook_prefix = true;
+    if (!strcmp(action, "hibernate")) {
+        log_info("Running pre-hibernate hooks");
+
+        char boot_id[1024];
+        if (!read_first_line_from_file("/proc/sys/kernel/random/boot_id", boot_id)) {
+            notify_vm_host(HOST_VM_NOTIFY_PRE_HIBERNATION_FAILED);
+            log_fatal("Couldn't read boot ID: %s. We need this to detect cold boots!", strerror(errno));
         }
 
-        char pattern[] = "/tmp/hibernation-setup-tool/hibernatedXXXXXX";
-        int fd = mkostemp(pattern, O_CLOEXEC);
+        /* No need to fsync(): the kernel syncs file systems before it
+         * writes the hibernation image. */
+        int fd = open(hibernated_boot_id_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_NOFOLLOW, 0600);
+        if (fd < 0 && errno == ENOENT && ensure_state_dir())
+            fd = open(hibernated_boot_id_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_NOFOLLOW, 0600);
         if (fd < 0) {
             notify_vm_host(HOST_VM_NOTIFY_PRE_HIBERNATION_FAILED);
-            log_fatal("Couldn't create a temporary file: %s", strerror(errno));
+            log_fatal("Couldn't create %s: %s", hibernated_boot_id_path, strerror(errno));
         }
-        close(fd);
 
-        if (unlink(hibernate_lock_file_name) < 0) {
-            if (!access(hibernate_lock_file_name, F_OK)) {
-                notify_vm_host(HOST_VM_NOTIFY_PRE_HIBERNATION_FAILED);
-                log_fatal("Couldn't remove %s: %s", hibernate_lock_file_name, strerror(errno));
-            }
+        size_t len = strlen(boot_id);
+        boot_id[len++] = '\n';
+        if (write(fd, boot_id, len) != (ssize_t)len) {
+            notify_vm_host(HOST_VM_NOTIFY_PRE_HIBERNATION_FAILED);
+            log_fatal("Couldn't write to %s: %s", hibernated_boot_id_path, strerror(errno));
         }
+        close(fd);
 
-        if (symlink(pattern, hibernate_lock_file_name) < 0) {
-            int symlink_errno = errno;
-            notify_vm_host(HOST_VM_NOTIFY_PRE_HIBERNATION_FAILED);
-            log_fatal("Couldn't symlink %s to %s: %s", pattern, hibernate_lock_file_name, strerror(symlink_errno));
+        apply_image_size_tuning();
+
+        /* Not a problem if this fails; there just won't be statistics about
+         * this hibernation cycle. */
+        fd = open("/dev/kmsg", O_WRONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            dprintf(fd, "%s\n", kmsg_cycle_marker);
+            close(fd);
         }
 
         notify_vm_host(HOST_VM_NOTIFY_HIBERNATING);
@@ -1621,34 +5889,16 @@ static int handle_post_systemd_suspend_notification(const char *action)
 {
     log_needs_post_hook_prefix = true;
     if (!strcmp(action, "hibernate")) {
-        char real_path_buf[PATH_MAX];
-        const char *real_path;
-
         log_info("Running post-hibernate hooks");
 
-        real_path = readlink0(hibernate_lock_file_name, real_path_buf);
-        if (!real_path) {
-            /* No need to notify host VM here: if link wasn't there, it's most likely that the
-             * pre-hibernation hooks failed to create it in the first place.  Log for debugging
-             * but keep going. */
-            log_info("This is probably fine, but couldn't readlink(%s): %s", hibernate_lock_file_name, strerror(errno));
-        } else if (unlink(real_path) < 0) {
-            log_info("This is fine, but couldn't remove %s: %s", real_path, strerror(errno));
-        }
-        if (unlink(hibernate_lock_file_name) < 0)
-            log_info("This is fine, but couldn't remove %s: %s", hibernate_lock_file_name, strerror(errno));
+        if (unlink(hibernated_boot_id_path) < 0)
+            log_info("This is fine, but couldn't remove %s: %s", hibernated_boot_id_path, strerror(errno));
 
-        if (umount2("/tmp/hibernation-setup-tool", UMOUNT_NOFOLLOW | MNT_DETACH) < 0) {
-            /* EINVAL is returned if this isn't a mount point. This is normal if /tmp was already
-             * a tmpfs and we didn't create and mounted this directory in the pre-hibernate hook.
-             * Calling umount2() is cheaper than checking if this directory is indeed mounted as
-             * a tmpfs directory. */
-            if (errno != EINVAL)
-                log_info("While unmounting /tmp/hibernation-setup-tool: %s", strerror(errno));
-        }
+        struct hibernation_sample sample;
+        bool have_sample = record_hibernation_cycle(&sample);
 
-        if (!recursive_rmdir("/tmp/hibernation-setup-tool"))
-            log_info("While removing /tmp/hibernation-setup-tool: %s", strerror(errno));
+        increment_counter(false);
+        write_hook_metrics(have_sample ? &sample : NULL);
 
         notify_vm_host(HOST_VM_NOTIFY_RESUMED_FROM_HIBERNATION);
         log_info("Post-hibernation hooks executed successfully");
@@ -1692,9 +5942,54 @@ int main(int argc, char *argv[])
     char *when = NULL; 
     char *action = NULL; 
 
-    if (argc > 2) { 
+    if (argc > 1) { 
+        enum {
+            OPT_SIZE_TOLERANCE = 256,
+            OPT_SWAPOFF_TIMEOUT,
+            OPT_DEFRAG_THRESHOLD,
+            OPT_DEFRAG_BUDGET,
+            OPT_DEFRAG_IO_BUDGET,
+            OPT_ZERO_CHUNK_SIZE,
+            OPT_ZERO_QUEUE_DEPTH,
+            OPT_XFS_EXTENT_SIZE,
+            OPT_FORCE,
+            OPT_IMDS_CACHE_TTL,
+            OPT_TRACE,
+            OPT_PROMETHEUS_DIR,
+            OPT_LOG_FORMAT,
+            OPT_SIZING,
+            OPT_SIZING_MARGIN,
+            OPT_REPORT_COMPRESSIBILITY,
+            OPT_HIBERNATE_TIME_BUDGET,
+            OPT_TARGET_HIBERNATE_TIME,
+            OPT_RESERVED_SIZE,
+            OPT_SELECT_COMPRESSOR,
+        };
+        static const struct option long_options[] = {
+            {"size-tolerance", required_argument, NULL, OPT_SIZE_TOLERANCE},
+            {"swapoff-timeout", required_argument, NULL, OPT_SWAPOFF_TIMEOUT},
+            {"defrag-threshold", required_argument, NULL, OPT_DEFRAG_THRESHOLD},
+            {"defrag-budget", required_argument, NULL, OPT_DEFRAG_BUDGET},
+            {"defrag-io-budget", required_argument, NULL, OPT_DEFRAG_IO_BUDGET},
+            {"zero-chunk-size", required_argument, NULL, OPT_ZERO_CHUNK_SIZE},
+            {"zero-queue-depth", required_argument, NULL, OPT_ZERO_QUEUE_DEPTH},
+            {"xfs-extent-size", required_argument, NULL, OPT_XFS_EXTENT_SIZE},
+            {"force", no_argument, NULL, OPT_FORCE},
+            {"imds-cache-ttl", required_argument, NULL, OPT_IMDS_CACHE_TTL},
+            {"trace", required_argument, NULL, OPT_TRACE},
+            {"prometheus-dir", required_argument, NULL, OPT_PROMETHEUS_DIR},
+            {"log-format", required_argument, NULL, OPT_LOG_FORMAT},
+            {"sizing", required_argument, NULL, OPT_SIZING},
+            {"sizing-margin", required_argument, NULL, OPT_SIZING_MARGIN},
+            {"report-compressibility", no_argument, NULL, OPT_REPORT_COMPRESSIBILITY},
+            {"hibernate-time-budget", required_argument, NULL, OPT_HIBERNATE_TIME_BUDGET},
+            {"target-hibernate-time", required_argument, NULL, OPT_TARGET_HIBERNATE_TIME},
+            {"reserved-size", required_argument, NULL, OPT_RESERVED_SIZE},
+            {"select-compressor", no_argument, NULL, OPT_SELECT_COMPRESSOR},
+            {NULL, 0, NULL, 0},
+        };
         int opt;
-        while ((opt = getopt(argc, argv, "a:w:d:")) != -1)
+        while ((opt = getopt_long(argc, argv, "a:w:d:", long_options, NULL)) != -1)
         {
             switch (opt)
             {
@@ -1709,41 +6004,224 @@ int main(int argc, char *argv[])
                 case 'd':
                     dest_dir = optarg;
                     break;
+
+                case OPT_SWAPOFF_TIMEOUT:
+                    swapoff_timeout_secs = (unsigned int)parse_option_or_die("swapoff-timeout", optarg, UINT_MAX);
+                    break;
+
+                case OPT_DEFRAG_THRESHOLD:
+                    defrag_threshold_pct = (unsigned int)parse_option_or_die("defrag-threshold", optarg, 1000);
+                    break;
+
+                case OPT_DEFRAG_BUDGET:
+                    defrag_budget_secs = (unsigned int)parse_option_or_die("defrag-budget", optarg, UINT_MAX);
+                    break;
+
+                case OPT_DEFRAG_IO_BUDGET:
+                    defrag_io_budget = parse_option_or_die("defrag-io-budget", optarg, SIZE_MAX / MEGA_BYTES) * MEGA_BYTES;
+                    break;
+
+                case OPT_ZERO_CHUNK_SIZE:
+                    zero_out_chunk_size = parse_option_or_die("zero-chunk-size", optarg, SIZE_MAX / MEGA_BYTES) * MEGA_BYTES;
+                    if (!zero_out_chunk_size)
+                        log_fatal("Chunk size must be at least 1 MB");
+                    break;
+
+                case OPT_ZERO_QUEUE_DEPTH:
+                    zero_out_queue_depth = (unsigned int)parse_option_or_die("zero-queue-depth", optarg, UINT_MAX);
+                    if (!zero_out_queue_depth || zero_out_queue_depth > 256)
+                        log_fatal("Queue depth must be between 1 and 256");
+                    break;
+
+                case OPT_XFS_EXTENT_SIZE:
+                    xfs_extent_size_hint = parse_option_or_die("xfs-extent-size", optarg, SIZE_MAX / MEGA_BYTES) * MEGA_BYTES;
+                    if (xfs_extent_size_hint > UINT32_MAX)
+                        log_fatal("Extent size hint must be smaller than 4096 MB");
+                    break;
+
+                case OPT_FORCE:
+                    force_full_run = true;
+                    break;
+
+                case OPT_IMDS_CACHE_TTL:
+                    imds_cache_ttl_secs = (unsigned int)parse_option_or_die("imds-cache-ttl", optarg, UINT_MAX);
+                    break;
+
+                case OPT_TRACE:
+                    trace_path = optarg;
+                    break;
+
+                case OPT_PROMETHEUS_DIR:
+                    prometheus_dir = optarg;
+                    break;
+
+                case OPT_LOG_FORMAT:
+                    if (!strcmp(optarg, "text"))
+                        log_format = LOG_FORMAT_TEXT;
+                    else if (!strcmp(optarg, "json"))
+                        log_format = LOG_FORMAT_JSON;
+                    else if (!strcmp(optarg, "journal"))
+                        log_format = LOG_FORMAT_JOURNAL;
+                    else
+                        log_fatal("Log format must be one of `text', `json' or `journal'");
+                    break;
+
+                case OPT_SIZING:
+                    if (!strcmp(optarg, "table"))
+                        swap_sizing = SWAP_SIZING_TABLE;
+                    else if (!strcmp(optarg, "image"))
+                        swap_sizing = SWAP_SIZING_IMAGE;
+                    else
+                        log_fatal("Sizing must be either `table' or `image'");
+                    break;
+
+                case OPT_SIZING_MARGIN:
+                    swap_sizing_margin_pct = (unsigned int)parse_option_or_die("sizing-margin", optarg, 1000);
+                    break;
+
+                case OPT_REPORT_COMPRESSIBILITY:
+                    report_compressibility_only = true;
+                    break;
+
+                case OPT_HIBERNATE_TIME_BUDGET:
+                    hibernate_time_budget_secs = (unsigned int)parse_option_or_die("hibernate-time-budget", optarg, MAX_HIBERNATE_TIME_SECS);
+                    break;
+
+                case OPT_TARGET_HIBERNATE_TIME:
+                    target_hibernate_time_secs = (unsigned int)parse_option_or_die("target-hibernate-time", optarg, MAX_HIBERNATE_TIME_SECS);
+                    break;
+
+                case OPT_RESERVED_SIZE:
+                    reserved_size_override = parse_option_or_die("reserved-size", optarg, SIZE_MAX / MEGA_BYTES) * MEGA_BYTES;
+                    break;
+
+                case OPT_SELECT_COMPRESSOR:
+                    select_compressor = true;
+                    break;
+
+                case OPT_SIZE_TOLERANCE:
+                    swap_size_tolerance_pct = (unsigned int)parse_option_or_die("size-tolerance", optarg, UINT_MAX);
+                    if (swap_size_tolerance_pct > 100)
+                        log_fatal("Size tolerance must be a percentage between 0 and 100");
+                    break;
+
+                default:
+                    log_fatal("Invalid usage of %s; see hibernation-setup-tool(1) for the list of options", argv[0]);
             }
         }
     }
 
+    resolve_log_format();
+
+    /* Also written when bailing out with log_fatal(). */
+    if (trace_path) {
+        trace_enabled = true;
+        atexit(write_trace);
+    }
+
     if (geteuid() != 0) {
         log_fatal("This program has to be executed with superuser privileges.");
         return 1;
     }
 
-    if (!is_hibernation_enabled_for_vm()) {
-        log_fatal("Hibernation not enabled for this VM.");
-        return 1;
+    if (report_compressibility_only)
+        return report_compressibility();
+
+    if (when && action) {
+        /* Hooks run right before the system freezes and right after it
+         * thaws, so they don't repeat any of the checks done when setting
+         * up: if they're being called, the system is hibernating. */
+        if (!is_hyperv()) {
+            /* We only handle these things here on Hyper-V VMs because it's the only
+             * hypervisor we know that might need these kinds of notifications. */
+            if (!strcmp(when, "pre") && !strcmp(action, "hibernate")) {
+                log_needs_pre_hook_prefix = true;
+                apply_image_size_tuning();
+            }
+            return 0;
+        }
+
+        struct trace_phase phase;
+        trace_begin(&phase, "hook");
+
+        int ret = handle_systemd_suspend_notification(argv[0], when, action);
+
+        trace_end(&phase);
+        log_info("`%s %s' hook took %" PRId64 " us", when, action, monotonic_usec() - phase.start_usec);
+
+        return ret;
     }
 
-    if (!is_hibernation_allowed_for_vm()) {
-        log_fatal("Hibernation not allowed for this VM. Please enable Hibernation during VM creation");
+    /* Phase durations are exported along with the setup metrics. */
+    if (get_prometheus_dir())
+        trace_enabled = true;
+
+    struct trace_phase phase;
+
+    trace_begin(&phase, "capability checks");
+    if (!is_hibernation_enabled_for_vm()) {
+        log_fatal("Hibernation not enabled for this VM.");
         return 1;
     }
+    trace_end(&phase);
 
-    if (is_hyperv()) {
-        /* We only handle these things here on Hyper-V VMs because it's the only
-         * hypervisor we know that might need these kinds of notifications. */
-        if (when && action)
-            return handle_systemd_suspend_notification(argv[0], when, action);
+    /* The unit runs on every boot; don't probe the system (or ask IMDS
+     * over the network) again if the configuration hasn't changed. */
+    if (!force_full_run) {
         log_needs_tool_prefix = true;
-        if (is_cold_boot())
-            notify_vm_host(HOST_VM_NOTIFY_COLD_BOOT);
+
+        struct configuration_fingerprint current;
+
+        trace_begin(&phase, "fingerprint check");
+        bool unchanged = !image_size_tuning_options_changed() && !is_compressor_selection_pending() && try_rearm_from_fingerprint(&current);
+        trace_end(&phase);
+
+        if (unchanged) {
+            apply_image_size_tuning();
+            if (is_hyperv() && is_cold_boot()) {
+                notify_vm_host(HOST_VM_NOTIFY_COLD_BOOT);
+                increment_counter(true);
+            }
+            write_setup_metrics(current.swap_path, current.size, current.n_extents);
+            return 0;
+        }
     }
 
+    struct imds_probe imds_probe = {0};
+    start_imds_probe(&imds_probe);
+
     log_needs_tool_prefix = true;
+    trace_begin(&phase, "discovery");
     size_t total_ram = physical_memory();
     if (!total_ram)
         log_fatal("Could not obtain memory total from this computer");
 
-    size_t needed_swap = swap_needed_size(total_ram);
+    select_swap_file_location();
+
+    /* Memory is only sampled once, so the budget, the tuning, the size of
+     * the swap area and the compressor selection all agree on how well the
+     * image compresses, and only if one of them needs it: the budget
+     * doesn't when even the uncompressed image would fit. */
+    size_t needed_swap = swap_sizing == SWAP_SIZING_TABLE ? swap_size_from_table(total_ram) : 0;
+    bool needs_ratio = (!needed_swap || target_hibernate_time_secs || !fits_hibernate_time_budget_uncompressed(total_ram)) &&
+                       !is_image_compression_disabled();
+    struct compressibility_estimate compressibility;
+    bool sampled = false;
+    if (needs_ratio || (select_compressor && is_compressor_selection_supported()))
+        sampled = estimate_memory_compressibility(&compressibility);
+
+    const char *ratio_source;
+    uint64_t ratio = measured_compression_ratio_permille(sampled && needs_ratio ? &compressibility : NULL, &ratio_source);
+
+    struct image_size_tuning tuning;
+    plan_hibernate_time_budget(total_ram, ratio);
+    plan_image_size_tuning(&tuning, ratio);
+
+    if (!needed_swap) {
+        if (swap_sizing == SWAP_SIZING_TABLE)
+            log_info("Size table doesn't cover machines with more than 256GB of RAM; sizing swap area for the hibernation image");
+        needed_swap = swap_needed_size_for_image(total_ram, ratio, ratio_source);
+    }
 
     log_info("System has %zu MB of RAM; needs a swap area of %zu MB", total_ram / MEGA_BYTES, needed_swap / MEGA_BYTES);
 
@@ -1754,57 +6232,142 @@ int main(int argc, char *argv[])
     } else {
         log_info("Swap file not found");
     }
+    trace_end(&phase);
 
-    if (swap && swap->capacity != needed_swap) {
-        log_info("Swap file %s has capacity of %zu MB but needs %zu MB. Recreating. "
-                 "System will run without a swap file while this is being set up.",
-                 swap->path, swap->capacity / MEGA_BYTES, needed_swap / MEGA_BYTES);
+    /* Nothing has been changed up to this point. */
+    trace_begin(&phase, "IMDS wait");
+    if (!finish_imds_probe(&imds_probe))
+        log_fatal("Hibernation not allowed for this VM. Please enable Hibernation during VM creation");
+    trace_end(&phase);
 
-        if (swapoff(swap->path) < 0) {
-            if (errno == EINVAL) {
-                log_info("%s is not currently being used as a swap partition. That's OK.", swap->path);
-            } else {
-                log_fatal("Could not disable swap file %s: %s", swap->path, strerror(errno));
-            }
-        }
+    trace_begin(&phase, "image size");
+    apply_hibernate_time_budget();
+    configure_image_size_tuning(&tuning);
+    trace_end(&phase);
+
+    if (is_hyperv() && is_cold_boot()) {
+        notify_vm_host(HOST_VM_NOTIFY_COLD_BOOT);
+        increment_counter(true);
+    }
 
-        if (unlink(swap->path) < 0) {
-            /* If we're trying to remove the file but it's not there anymore,
-             * that's fine... no need to error out. */
-            if (!access(swap->path, F_OK))
+    trace_begin(&phase, "cleanup");
+    remove_stale_swap_files();
+
+    size_t already_allocated = 0;
+    if (swap && is_swap_file_allocation_pending(swap->path, 0, NULL)) {
+        if (is_swap_file_allocation_pending(swap->path, needed_swap, &already_allocated)) {
+            log_info("Creation of %s was interrupted; it'll be resumed", swap->path);
+        } else {
+            log_info("Creation of %s was interrupted, but the needed size has changed; starting over", swap->path);
+            if (unlink(swap->path) < 0)
                 log_fatal("Could not remove swap file %s: %s", swap->path, strerror(errno));
+            clear_allocation_state();
         }
 
-        free(swap);
+        free_swap_file(swap);
         swap = NULL;
     }
+    trace_end(&phase);
 
     bool created = false;
+    if (swap && swap->capacity != needed_swap) {
+        struct swap_file *replacement;
+
+        trace_begin(&phase, "resize");
+        if (is_swap_size_within_tolerance(swap->capacity, needed_swap)) {
+            log_info("Swap file %s has capacity of %zu MB, within %u%% of the needed %zu MB. Keeping it.", swap->path, swap->capacity / MEGA_BYTES,
+                     swap_size_tolerance_pct, needed_swap / MEGA_BYTES);
+        } else if (try_resize_swap_file_in_place(swap, needed_swap)) {
+            created = true;
+        } else if ((replacement = replace_swap_file(swap, needed_swap))) {
+            free_swap_file(swap);
+            swap = replacement;
+            created = true;
+        } else {
+            log_info("Swap file %s has capacity of %zu MB but needs %zu MB. Recreating. "
+                     "System will run without a swap file while this is being set up.",
+                     swap->path, swap->capacity / MEGA_BYTES, needed_swap / MEGA_BYTES);
+
+            if (!swapoff_with_progress(swap->path))
+                log_fatal("Could not disable swap file %s", swap->path);
+
+            if (unlink(swap->path) < 0) {
+                /* If we're trying to remove the file but it's not there anymore,
+                 * that's fine... no need to error out. */
+                if (!access(swap->path, F_OK))
+                    log_fatal("Could not remove swap file %s: %s", swap->path, strerror(errno));
+            }
+
+            free_swap_file(swap);
+            swap = NULL;
+        }
+        trace_end(&phase);
+    }
+
+    if (swap && !created) {
+        bool rewritten;
+
+        trace_begin(&phase, "validation");
+        if (ensure_swap_file_is_usable(swap, &rewritten)) {
+            created = rewritten;
+        } else {
+            log_info("%s can't be used as a swap file and will be recreated", swap->path);
+
+            if (unlink(swap->path) < 0 && errno != ENOENT)
+                log_fatal("Could not remove swap file %s: %s", swap->path, strerror(errno));
+
+            free_swap_file(swap);
+            swap = NULL;
+        }
+        trace_end(&phase);
+    }
+
     if (!swap) {
         log_info("Creating swap file with %zu MB", needed_swap / MEGA_BYTES);
 
-        size_t free_space = free_device_space();
+        size_t free_space = free_device_space() + already_allocated;
         if (free_space < needed_swap)
             log_fatal("System needs a swap area of %zu MB; but only has %zu MB free space on device", needed_swap / MEGA_BYTES, free_space / MEGA_BYTES);
 
-        swap = create_swap_file(needed_swap);
+        trace_begin(&phase, "creation");
+        swap = create_swap_file(swap_file_name, needed_swap);
         if (!swap)
             log_fatal("Could not create swap file");
+        trace_end(&phase);
 
         created = true;
     }
 
+    log_set_swap_file(swap->path);
+
+    trace_begin(&phase, "enabling swap");
     ensure_swap_is_enabled(swap, created);
+    trace_end(&phase);
+
+    trace_begin(&phase, "compressor selection");
+    select_hibernation_compressor(total_ram, sampled ? &compressibility : NULL);
+    trace_end(&phase);
+
+    trace_begin(&phase, "resume configuration");
     if (!update_swap_offset(swap))
         log_fatal("Could not update swap offset.");
+    trace_end(&phase);
 
     if (is_hyperv()) {
+        trace_begin(&phase, "udev rules");
         ensure_udev_rules_are_installed();
+        trace_end(&phase);
     }
 
+    trace_begin(&phase, "fingerprint save");
+    save_configuration_fingerprint(swap);
+    trace_end(&phase);
+
+    write_setup_metrics(swap->path, swap->capacity, swap_file_extents(swap)->n_extents);
+
     log_info("Swap file for VM hibernation set up successfully");
 
-    free(swap);
+    free_swap_file(swap);
 
     return 0;
 }